@@ -22,6 +22,7 @@
 
 #include <algorithm>
 #include <string>
+#include <limits>
 #include "vector.h"
 #include "util.h"
 using std::min;
@@ -54,6 +55,46 @@ struct RRay: Ray {
 	}
 };
 
+/// A packet of rays, which are traced together (e.g., the primary rays through a 2x2 pixel block).
+/// The rays are supposed to be coherent, i.e. to start near each other and go in similar directions.
+/// Not all rays need to be in use; the used ones are marked in `mask'.
+struct RayPacket {
+	RRay rays[PACKET_SIZE];
+	int mask; //!< which rays are in use (bit i corresponds to rays[i])
+	// the rays' origins and rdir's, in a SIMD-friendly layout (start[dim][i] is rays[i].start[dim]).
+	// They're zero for the unused rays, so loops over all rays may skip checking the mask.
+	double start[3][PACKET_SIZE], rdir[3][PACKET_SIZE];
+	RayPacket() { mask = 0; }
+	/// computes the rdir's of all rays, and fills in start[][] and rdir[][]
+	void prepareForTracing()
+	{
+		for (int i = 0; i < PACKET_SIZE; i++) {
+			bool used = (mask & (1 << i)) != 0;
+			if (used) rays[i].prepareForTracing();
+			for (int dim = 0; dim < 3; dim++) {
+				start[dim][i] = used ? rays[i].start[dim] : 0;
+				rdir[dim][i] = used ? rays[i].rdir[dim] : 0;
+			}
+		}
+	}
+	/// checks if the rays in the given mask all go in the same direction along each axis (have
+	/// the same signs of rdir). This is required for tracing them together through a KD-tree.
+	bool sameDirections(int mask) const
+	{
+		int first = -1;
+		for (int i = 0; i < PACKET_SIZE; i++) if (mask & (1 << i)) {
+			if (first == -1) {
+				first = i;
+				continue;
+			}
+			for (int dim = 0; dim < 3; dim++)
+				if ((rays[i].rdir[dim] > 0) != (rays[first].rdir[dim] > 0))
+					return false;
+		}
+		return true;
+	}
+};
+
 enum Axis {
 	AXIS_X,
 	AXIS_Y,
@@ -86,12 +127,27 @@ struct BBox {
 		vmin.y = min(vmin.y, vec.y); vmax.y = max(vmax.y, vec.y);
 		vmin.z = min(vmin.z, vec.z); vmax.z = max(vmax.z, vec.z);
 	}
+	/// add another box to the bounding box, so that the result encompasses both
+	inline void add(const BBox& rhs)
+	{
+		vmin.x = min(vmin.x, rhs.vmin.x); vmax.x = max(vmax.x, rhs.vmax.x);
+		vmin.y = min(vmin.y, rhs.vmin.y); vmax.y = max(vmax.y, rhs.vmax.y);
+		vmin.z = min(vmin.z, rhs.vmin.z); vmax.z = max(vmax.z, rhs.vmax.z);
+	}
+	/// returns the surface area of the box (zero for an empty box)
+	inline double area() const
+	{
+		Vector d = vmax - vmin;
+		if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+		return 2 * (d.x * d.y + d.x * d.z + d.y * d.z);
+	}
 	/// Checks if a point is inside the bounding box (borders-inclusive)
 	inline bool inside(const Vector& v) const
 	{
-		return (vmin.x - 1e-6 <= v.x && v.x <= vmax.x + 1e-6 &&
-		        vmin.y - 1e-6 <= v.y && v.y <= vmax.y + 1e-6 &&
-		        vmin.z - 1e-6 <= v.z && v.z <= vmax.z + 1e-6);
+		real eps = surfaceEpsilon(v);
+		return (vmin.x - eps <= v.x && v.x <= vmax.x + eps &&
+		        vmin.y - eps <= v.y && v.y <= vmax.y + eps &&
+		        vmin.z - eps <= v.z && v.z <= vmax.z + eps);
 	}
 	/// Test for ray-box intersection
 	/// @returns true if an intersection exists; false otherwise.
@@ -171,43 +227,82 @@ struct BBox {
 		}
 		return minDist;
 	}
-	/// Check whether the box intersects a triangle (all three cases)
-	inline bool intersectTriangle(const Vector& A, const Vector& B, const Vector& C) const
+	/// Clips the interval [tmin, tmax] along the ray against the box (the "slab" test).
+	/// @returns true if the ray intersects the box somewhere within the (now shrunk) interval.
+	inline bool clip(const RRay& ray, double& tmin, double& tmax) const
 	{
-		if (inside(A) || inside(B) || inside(C)) return true;
-		RRay ray;
-		Vector t[3] = { A, B, C };
-		for (int i = 0; i < 3; i++) for (int j = i + 1; j < 3; j++) {
-			ray.start = t[i];
-			ray.dir = t[j] - t[i];
-			ray.prepareForTracing();
-			if (testIntersect(ray)) {
-				ray.start = t[j];
-				ray.dir = t[i] - t[j];
-				ray.prepareForTracing();
-				if (testIntersect(ray)) return true;
-			}
+		for (int dim = 0; dim < 3; dim++) {
+			double t0 = (vmin[dim] - ray.start[dim]) * ray.rdir[dim];
+			double t1 = (vmax[dim] - ray.start[dim]) * ray.rdir[dim];
+			if (t0 > t1) std::swap(t0, t1);
+			if (t0 > tmin) tmin = t0;
+			if (t1 < tmax) tmax = t1;
+			if (tmin > tmax) return false;
 		}
-		Triangle T;
-		Vector AB = B - A;
-		Vector AC = C - A;
-		Vector ABcrossAC = AB ^ AC;
-		double D = A * ABcrossAC;
-		for (int mask = 0; mask < 7; mask++) {
-			for (int j = 0; j < 3; j++) {
-				if (mask & (1 << j)) continue;
-				ray.start.set((mask & 1) ? vmax.x : vmin.x, (mask & 2) ? vmax.y : vmin.y, (mask & 4) ? vmax.z : vmin.z);
-				Vector rayEnd = ray.start;
-				rayEnd[j] = vmax[j];
-				if (signOf(ray.start * ABcrossAC - D) != signOf(rayEnd * ABcrossAC - D)) {
-					ray.dir = rayEnd - ray.start;
-					ray.prepareForTracing();
-					double dist = INF;
-					if (intersectTriangleFast(ray, A, B, C, dist)) return true;
-				}
+		return true;
+	}
+	/// clip() for a (prepared) packet of rays: clips the intervals [tmin[i], tmax[i]] of all rays (so these must be
+	/// initialized for the unused rays as well). The rays are processed together, to allow for vectorization.
+	/// @returns the mask of the rays in `mask', that intersect the box within their intervals.
+	inline int clip(const RayPacket& packet, double tmin[], double tmax[], int mask) const
+	{
+		for (int dim = 0; dim < 3; dim++) {
+			for (int i = 0; i < PACKET_SIZE; i++) {
+				double t0 = (vmin[dim] - packet.start[dim][i]) * packet.rdir[dim][i];
+				double t1 = (vmax[dim] - packet.start[dim][i]) * packet.rdir[dim][i];
+				tmin[i] = max(tmin[i], min(t0, t1));
+				tmax[i] = min(tmax[i], max(t0, t1));
 			}
 		}
-		return false;
+		int result = 0;
+		for (int i = 0; i < PACKET_SIZE; i++)
+			result |= (tmin[i] <= tmax[i]) << i;
+		return result & mask;
+	}
+	/// Check whether the box intersects a triangle. This is the separating axis test (Akenine-Moller, 2001): the two
+	/// don't overlap iff their projections on some axis don't overlap, and it's enough to check the box's axes, the
+	/// triangle's normal, and the nine cross products of a box axis and a triangle edge. Touching counts as
+	/// overlapping, and a small tolerance is added for the roundoff, so this errs on the side of including the
+	/// triangle. Flat boxes (e.g., lying inside a coplanar triangle) are handled as well.
+	inline bool intersectTriangle(const Vector& A, const Vector& B, const Vector& C) const
+	{
+		Vector center = (vmin + vmax) * 0.5;
+		Vector half = (vmax - vmin) * 0.5;
+		Vector v[3] = { A - center, B - center, C - center }; // the triangle, relative to the box's center
+		// the roundoff is relative to the largest operand, including the absolute coordinates (which are lost
+		// in the subtractions above, if the mesh is far from the origin):
+		real scale = max(half.x, max(half.y, half.z));
+		scale = max(scale, max((real) fabs(center.x), max((real) fabs(center.y), (real) fabs(center.z))));
+		for (int i = 0; i < 3; i++)
+			scale = max(scale, max((real) fabs(v[i].x), max((real) fabs(v[i].y), (real) fabs(v[i].z))));
+		// a few ulps of it (in either precision):
+		real tolerance = scale * (64 * std::numeric_limits<real>::epsilon());
+		Vector edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+		// the box's axes:
+		for (int dim = 0; dim < 3; dim++) {
+			Vector axis(0, 0, 0);
+			axis[dim] = 1;
+			if (separatedOnAxis(axis, v, half, tolerance)) return false;
+		}
+		// the triangle's normal:
+		if (separatedOnAxis(edges[0] ^ edges[1], v, half, tolerance)) return false;
+		// the edge x axis products:
+		for (int i = 0; i < 3; i++)
+			for (int dim = 0; dim < 3; dim++) {
+				Vector axis(0, 0, 0);
+				axis[dim] = 1;
+				if (separatedOnAxis(axis ^ edges[i], v, half, tolerance)) return false;
+			}
+		return true;
+	}
+	/// a helper for intersectTriangle(): checks whether the projections of the triangle `v' and of a box with the given
+	/// half-size, centered at the origin, on `axis' are farther apart than `tolerance' (scaled by the axis' length)
+	static inline bool separatedOnAxis(const Vector& axis, const Vector v[3], const Vector& half, real tolerance)
+	{
+		real p0 = dot(axis, v[0]), p1 = dot(axis, v[1]), p2 = dot(axis, v[2]);
+		real absSum = fabs(axis.x) + fabs(axis.y) + fabs(axis.z);
+		real r = half.x * fabs(axis.x) + half.y * fabs(axis.y) + half.z * fabs(axis.z) + tolerance * absSum;
+		return min(p0, min(p1, p2)) > r || max(p0, max(p1, p2)) < -r;
 	}
 	/// Split a bounding box along an given axis at a given position, yielding a two child bboxen
 	/// @param axis - an axis to use for splitting (AXIS_X, AXIS_Y or AXIS_Z)
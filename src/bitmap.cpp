@@ -235,7 +235,7 @@ bool Bitmap::saveBMP(const char* filename)
 	if (!fp) return false;
 	BmpHeader hd;
 	BmpInfoHeader hi;
-	char xx[VFB_MAX_SIZE * 3];
+	char* xx;
 
 
 	// fill in the header:
@@ -257,6 +257,8 @@ bool Bitmap::saveBMP(const char* filename)
 	fwrite(&BM_MAGIC, 2, 1, fp); // write 'BM'
 	fwrite(&hd, sizeof(hd), 1, fp); // write file header
 	fwrite(&hi, sizeof(hi), 1, fp); // write image header
+	xx = new char[rowsz];
+	memset(xx, 0, rowsz);
 	for (int y = height - 1; y >= 0; y--) {
 		for (int x = 0; x < width; x++) {
 			unsigned t = getPixel(x, y).toRGB32();
@@ -266,6 +268,7 @@ bool Bitmap::saveBMP(const char* filename)
 		}
 		fwrite(xx, rowsz, 1, fp);
 	}
+	delete [] xx;
 	fclose(fp);
 	return true;
 }
@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <algorithm>
+#include "buckets.h"
+using std::vector;
+using std::min;
+using std::max;
+
+const int COST_CELL_SIZE = 16; //!< matches the block size of the prepass
+const int BUCKET_SPLIT_FACTOR = 8;
+const int MIN_BUCKET_SIZE = 8;
+
+void CostMap::reset(int frameW, int frameH)
+{
+	cellsX = (frameW - 1) / COST_CELL_SIZE + 1;
+	cellsY = (frameH - 1) / COST_CELL_SIZE + 1;
+	cost.assign(cellsX * cellsY, 0.0);
+}
+
+bool CostMap::covers(int frameW, int frameH) const
+{
+	return cellsX == (frameW - 1) / COST_CELL_SIZE + 1 && cellsY == (frameH - 1) / COST_CELL_SIZE + 1;
+}
+
+void CostMap::record(const Rect& r, double seconds)
+{
+	if (r.w <= 0 || r.h <= 0) return;
+	double perPixel = seconds / (r.w * r.h);
+	for (int cy = r.y0 / COST_CELL_SIZE; cy <= (r.y1 - 1) / COST_CELL_SIZE && cy < cellsY; cy++) {
+		int overlapY = min(r.y1, (cy + 1) * COST_CELL_SIZE) - max(r.y0, cy * COST_CELL_SIZE);
+		for (int cx = r.x0 / COST_CELL_SIZE; cx <= (r.x1 - 1) / COST_CELL_SIZE && cx < cellsX; cx++) {
+			int overlapX = min(r.x1, (cx + 1) * COST_CELL_SIZE) - max(r.x0, cx * COST_CELL_SIZE);
+			cost[cy * cellsX + cx] += perPixel * overlapX * overlapY;
+		}
+	}
+}
+
+double CostMap::estimate(const Rect& r) const
+{
+	// the cost of a cell is assumed to be evenly spread over its pixels:
+	const double cellArea = COST_CELL_SIZE * COST_CELL_SIZE;
+	double result = 0;
+	for (int cy = r.y0 / COST_CELL_SIZE; cy <= (r.y1 - 1) / COST_CELL_SIZE && cy < cellsY; cy++) {
+		int overlapY = min(r.y1, (cy + 1) * COST_CELL_SIZE) - max(r.y0, cy * COST_CELL_SIZE);
+		for (int cx = r.x0 / COST_CELL_SIZE; cx <= (r.x1 - 1) / COST_CELL_SIZE && cx < cellsX; cx++) {
+			int overlapX = min(r.x1, (cx + 1) * COST_CELL_SIZE) - max(r.x0, cx * COST_CELL_SIZE);
+			result += cost[cy * cellsX + cx] * (overlapX * overlapY / cellArea);
+		}
+	}
+	return result;
+}
+
+struct ScheduledBucket {
+	Rect r;
+	double cost;
+	int order; //!< position in the original list; used to keep ties in their original (zigzag) order
+	
+	bool operator < (const ScheduledBucket& rhs) const
+	{
+		if (cost != rhs.cost) return cost > rhs.cost;
+		return order < rhs.order;
+	}
+};
+
+static void splitBucket(const Rect& r, const CostMap& costs, double maxCost, int order, vector<ScheduledBucket>& result)
+{
+	ScheduledBucket b;
+	b.r = r;
+	b.cost = costs.estimate(r);
+	b.order = order;
+	bool canSplit = max(r.w, r.h) >= 2 * MIN_BUCKET_SIZE;
+	if (b.cost <= maxCost || !canSplit) {
+		result.push_back(b);
+		return;
+	}
+	// split across the longer side:
+	if (r.w >= r.h) {
+		int mid = r.x0 + r.w / 2;
+		splitBucket(Rect(r.x0, r.y0, mid, r.y1), costs, maxCost, order, result);
+		splitBucket(Rect(mid, r.y0, r.x1, r.y1), costs, maxCost, order, result);
+	} else {
+		int mid = r.y0 + r.h / 2;
+		splitBucket(Rect(r.x0, r.y0, r.x1, mid), costs, maxCost, order, result);
+		splitBucket(Rect(r.x0, mid, r.x1, r.y1), costs, maxCost, order, result);
+	}
+}
+
+void scheduleBuckets(vector<Rect>& buckets, const CostMap& costs, int threads)
+{
+	if (!costs.covers(frameWidth(), frameHeight())) return;
+	
+	double total = 0;
+	for (int i = 0; i < (int) buckets.size(); i++)
+		total += costs.estimate(buckets[i]);
+	if (total <= 0) return;
+	
+	double maxCost = total / (max(threads, 1) * BUCKET_SPLIT_FACTOR);
+	vector<ScheduledBucket> scheduled;
+	for (int i = 0; i < (int) buckets.size(); i++)
+		splitBucket(buckets[i], costs, maxCost, i, scheduled);
+	std::stable_sort(scheduled.begin(), scheduled.end());
+	
+	buckets.resize(scheduled.size());
+	for (int i = 0; i < (int) scheduled.size(); i++)
+		buckets[i] = scheduled[i].r;
+}
@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef __BUCKETS_H__
+#define __BUCKETS_H__
+
+#include <vector>
+#include "sdl.h"
+
+/**
+ * @Brief an estimate of how expensive it is to render each part of the image
+ *
+ * The image is divided into a grid of COST_CELL_SIZE x COST_CELL_SIZE cells, and the render time
+ * (in seconds) spent in each cell is accumulated. The timings come either from the prepass (which
+ * shoots a single ray for each 16x16 block, so the timings are proportional, but much smaller), or
+ * from the buckets of the previous frame. Only the relative magnitudes matter.
+ */
+class CostMap {
+	int cellsX, cellsY;
+	std::vector<double> cost;
+public:
+	CostMap(): cellsX(0), cellsY(0) {}
+	
+	void reset(int frameW, int frameH); //!< clears all estimates, and sets up the grid for a frame of the given size
+	bool covers(int frameW, int frameH) const; //!< true if there are estimates for a frame of the given size
+	void record(const Rect& r, double seconds); //!< adds the time it took to render `r' (evenly spread over its area)
+	double estimate(const Rect& r) const; //!< the estimated cost of rendering `r'
+};
+
+/**
+ * Prepares buckets for dispatching, according to the cost estimates:
+ * 1) buckets, which would take more than 1/(threads * BUCKET_SPLIT_FACTOR) of the total time,
+ *    are split in halves (recursively, down to MIN_BUCKET_SIZE pixels);
+ * 2) the buckets are sorted, so that the most expensive come first. Thus the cheap ones are left
+ *    for the end of the frame, where they fill the gaps, and no thread is left alone with a
+ *    big bucket, while the others are idle.
+ *
+ * @param buckets - the buckets to process (e.g., from getBucketsList()); modified in-place.
+ * @param costs   - the cost estimates; if they don't cover the frame, the buckets are left untouched.
+ * @param threads - how many threads will render the buckets.
+ */
+void scheduleBuckets(std::vector<Rect>& buckets, const CostMap& costs, int threads);
+
+#endif // __BUCKETS_H__
@@ -0,0 +1,286 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <algorithm>
+#include <SDL/SDL.h>
+#include "bvh.h"
+#include "constants.h"
+using std::vector;
+using std::swap;
+
+const int BVH_NUM_BINS = 16;
+const int BVH_MAX_LEAF_SIZE = 4;
+
+// the world-space bbox of a node, grown slightly, so that flat geometries (e.g. limited planes) don't get
+// missed due to roundoff errors in the slab test. Returns false if the node is unbounded.
+static bool getNodeBBox(Node* node, BBox& bbox)
+{
+	if (!node->getBBox(bbox)) return false;
+	real epsMin = surfaceEpsilon(bbox.vmin), epsMax = surfaceEpsilon(bbox.vmax);
+	bbox.vmin += Vector(-epsMin, -epsMin, -epsMin);
+	bbox.vmax += Vector(+epsMax, +epsMax, +epsMax);
+	return true;
+}
+
+void SceneBVH::build(const vector<Node*>& sceneNodes)
+{
+	Uint32 ticks = SDL_GetTicks();
+	tree.clear();
+	nodes.clear();
+	unbounded.clear();
+	vector<BuildItem> items;
+	for (int i = 0; i < (int) sceneNodes.size(); i++) {
+		BuildItem item;
+		item.node = sceneNodes[i];
+		if (!getNodeBBox(item.node, item.bbox)) {
+			unbounded.push_back(item.node);
+			continue;
+		}
+		item.center = (item.bbox.vmin + item.bbox.vmax) * 0.5;
+		items.push_back(item);
+	}
+	if (!items.empty()) {
+		tree.reserve(2 * items.size());
+		build(items, 0, (int) items.size(), 0);
+	}
+	for (int i = 0; i < (int) items.size(); i++)
+		nodes.push_back(items[i].node);
+	Uint32 timeElapsed = SDL_GetTicks() - ticks;
+	printf("BVH built: %d nodes (%d unbounded), %d tree nodes in %d ms\n",
+		(int) sceneNodes.size(), (int) unbounded.size(), (int) tree.size(), timeElapsed);
+}
+
+bool SceneBVH::refit(void)
+{
+	for (int i = 0; i < (int) unbounded.size(); i++) {
+		BBox bbox;
+		if (getNodeBBox(unbounded[i], bbox)) return false;
+	}
+	// the children always come after their parent in tree[], so a backward sweep updates them first:
+	for (int i = (int) tree.size() - 1; i >= 0; i--) {
+		BVHNode& t = tree[i];
+		if (t.right == -1) {
+			t.bbox.makeEmpty();
+			for (int j = t.first; j < t.first + t.count; j++) {
+				BBox bbox;
+				if (!getNodeBBox(nodes[j], bbox)) return false;
+				t.bbox.add(bbox);
+			}
+		} else {
+			t.bbox = tree[i + 1].bbox;
+			t.bbox.add(tree[t.right].bbox);
+		}
+	}
+	return true;
+}
+
+// builds the subtree over items[from .. to - 1]; returns the index of the subtree root in tree[]
+int SceneBVH::build(vector<BuildItem>& items, int from, int to, int depth)
+{
+	int index = (int) tree.size();
+	tree.push_back(BVHNode());
+	BBox bbox, centers;
+	bbox.makeEmpty();
+	centers.makeEmpty();
+	for (int i = from; i < to; i++) {
+		bbox.add(items[i].bbox);
+		centers.add(items[i].center);
+	}
+	tree[index].bbox = bbox;
+	tree[index].first = from;
+	tree[index].count = to - from;
+	tree[index].right = -1;
+	tree[index].axis = AXIS_NONE;
+	
+	int count = to - from;
+	if (count <= 1 || depth >= MAX_TREE_DEPTH) return index;
+	
+	// split along the axis, where the centers of the boxes are most spread out:
+	int axis = (centers.vmax - centers.vmin).maxDimension();
+	double axisL = centers.vmin[axis];
+	double axisR = centers.vmax[axis];
+	if (axisR - axisL < 1e-9) {
+		// all boxes share the same center; there isn't a sensible way to split them
+		return index;
+	}
+	
+	// bin the boxes by their centers and evaluate the SAH cost of splitting after each bin:
+	double binScale = BVH_NUM_BINS / (axisR - axisL) * (1 - 1e-9);
+	BBox binBoxes[BVH_NUM_BINS];
+	int binCounts[BVH_NUM_BINS] = { 0 };
+	for (int i = 0; i < BVH_NUM_BINS; i++) binBoxes[i].makeEmpty();
+	for (int i = from; i < to; i++) {
+		int bin = (int) ((items[i].center[axis] - axisL) * binScale);
+		binBoxes[bin].add(items[i].bbox);
+		binCounts[bin]++;
+	}
+	double leftAreas[BVH_NUM_BINS];
+	int leftCounts[BVH_NUM_BINS];
+	BBox acc;
+	acc.makeEmpty();
+	int n = 0;
+	for (int i = 0; i < BVH_NUM_BINS - 1; i++) {
+		acc.add(binBoxes[i]);
+		n += binCounts[i];
+		leftAreas[i] = acc.area();
+		leftCounts[i] = n;
+	}
+	acc.makeEmpty();
+	n = 0;
+	int bestSplit = -1;
+	double bestCost = INF;
+	for (int i = BVH_NUM_BINS - 1; i > 0; i--) {
+		acc.add(binBoxes[i]);
+		n += binCounts[i];
+		if (!n || !leftCounts[i - 1]) continue;
+		double cost = leftAreas[i - 1] * leftCounts[i - 1] + acc.area() * n;
+		if (cost < bestCost) {
+			bestCost = cost;
+			bestSplit = i;
+		}
+	}
+	// the cost of a leaf is bbox.area() * count; create one if splitting doesn't pay off:
+	if (bestSplit == -1 || (count <= BVH_MAX_LEAF_SIZE && bestCost >= bbox.area() * count))
+		return index;
+	
+	// partition the items: the ones in bins [0 .. bestSplit - 1] go to the left:
+	BuildItem* mid = std::partition(&items[from], &items[from] + count,
+		[=] (const BuildItem& item) { return (int) ((item.center[axis] - axisL) * binScale) < bestSplit; });
+	int split = from + (int) (mid - &items[from]);
+	
+	tree[index].axis = axis;
+	tree[index].count = 0;
+	build(items, from, split, depth + 1); // the left child is at index + 1
+	int right = build(items, split, to, depth + 1);
+	tree[index].right = right;
+	return index;
+}
+
+Node* SceneBVH::intersect(const Ray& ray, IntersectionData& data)
+{
+	Node* closestNode = NULL;
+	// check the unbounded nodes first; they may shrink data.dist, so that more of the tree gets culled:
+	for (int i = 0; i < (int) unbounded.size(); i++)
+		if (unbounded[i]->findHit(ray, data))
+			closestNode = unbounded[i];
+	
+	if (tree.empty()) return closestNode;
+	RRay rray(ray);
+	rray.prepareForTracing();
+	int stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		int index = stack[--sp];
+		const BVHNode& node = tree[index];
+		double tmin = 0, tmax = data.dist;
+		if (!node.bbox.clip(rray, tmin, tmax)) continue;
+		if (node.right == -1) {
+			for (int i = node.first; i < node.first + node.count; i++)
+				if (nodes[i]->findHit(ray, data))
+					closestNode = nodes[i];
+		} else {
+			// push the further child first, so that the closer is visited first:
+			int closer = index + 1, further = node.right;
+			if (ray.dir[node.axis] < 0) swap(closer, further);
+			stack[sp++] = further;
+			stack[sp++] = closer;
+		}
+	}
+	return closestNode;
+}
+
+void SceneBVH::intersectPacket(const RayPacket& packet, IntersectionData data[], Node* closestNode[])
+{
+	for (int i = 0; i < (int) unbounded.size(); i++) {
+		int found = unbounded[i]->findHitPacket(packet, data, packet.mask);
+		for (int j = 0; j < PACKET_SIZE; j++)
+			if (found & (1 << j)) closestNode[j] = unbounded[i];
+	}
+	
+	if (tree.empty() || !packet.mask) return;
+	// the order of visiting the children is chosen by the first ray in the packet:
+	int first = 0;
+	while (!(packet.mask & (1 << first))) first++;
+	// each node is visited along with the rays, that hit its parent:
+	struct StackEntry {
+		int node, mask;
+	} stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	stack[sp].node = 0;
+	stack[sp++].mask = packet.mask;
+	while (sp > 0) {
+		sp--;
+		int index = stack[sp].node;
+		const BVHNode& node = tree[index];
+		// find out which rays hit the box; the node is skipped only if none of them does:
+		double tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+		for (int i = 0; i < PACKET_SIZE; i++) {
+			tmin[i] = 0;
+			tmax[i] = (packet.mask & (1 << i)) ? data[i].dist : 0;
+		}
+		int mask = node.bbox.clip(packet, tmin, tmax, stack[sp].mask);
+		if (!mask) continue;
+		if (node.right == -1) {
+			for (int i = node.first; i < node.first + node.count; i++) {
+				int found = nodes[i]->findHitPacket(packet, data, mask);
+				for (int j = 0; j < PACKET_SIZE; j++)
+					if (found & (1 << j)) closestNode[j] = nodes[i];
+			}
+		} else {
+			int closer = index + 1, further = node.right;
+			if (packet.rays[first].dir[node.axis] < 0) swap(closer, further);
+			stack[sp].node = further;
+			stack[sp++].mask = mask;
+			stack[sp].node = closer;
+			stack[sp++].mask = mask;
+		}
+	}
+}
+
+bool SceneBVH::occluded(const Ray& ray, double maxDist)
+{
+	for (int i = 0; i < (int) unbounded.size(); i++)
+		if (unbounded[i]->occluded(ray, maxDist))
+			return true;
+	
+	if (tree.empty()) return false;
+	RRay rray(ray);
+	rray.prepareForTracing();
+	int stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	stack[sp++] = 0;
+	while (sp > 0) {
+		int index = stack[--sp];
+		const BVHNode& node = tree[index];
+		double tmin = 0, tmax = maxDist;
+		if (!node.bbox.clip(rray, tmin, tmax)) continue;
+		if (node.right == -1) {
+			for (int i = node.first; i < node.first + node.count; i++)
+				if (nodes[i]->occluded(ray, maxDist))
+					return true;
+		} else {
+			stack[sp++] = node.right;
+			stack[sp++] = index + 1;
+		}
+	}
+	return false;
+}
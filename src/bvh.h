@@ -0,0 +1,79 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <vector>
+#include "vector.h"
+#include "bbox.h"
+#include "geometry.h"
+
+/**
+ * @Brief a bounding volume hierarchy over the Nodes of the scene
+ *
+ * The tree is built from the world-space bounding boxes of the nodes (see Node::getBBox()),
+ * using a binned SAH (Surface Area Heuristic) split. It is stored as a flat array; an in-node's
+ * left child immediately follows it, and only the index of the right child is stored.
+ *
+ * Nodes that have no finite bounding box (e.g. infinite planes) can't be put in the tree; they're
+ * kept in a separate list, and are checked for every ray, before the tree is traversed.
+ */
+class SceneBVH {
+	struct BVHNode {
+		BBox bbox;
+		int axis;         //!< the split axis (only for in-nodes); used to visit the closer child first
+		int first, count; //!< (leaves only) which nodes are in the leaf: nodes[first .. first + count - 1]
+		int right;        //!< (in-nodes only) the index of the right child. A leaf has right == -1.
+	};
+	struct BuildItem {
+		Node* node;
+		BBox bbox;
+		Vector center;
+	};
+	std::vector<BVHNode> tree;
+	std::vector<Node*> nodes;     //!< all bounded nodes, in the order the leaves reference them
+	std::vector<Node*> unbounded; //!< nodes that can't be put in the tree
+	
+	int build(std::vector<BuildItem>& items, int from, int to, int depth);
+public:
+	/// (re)builds the tree over the given list of nodes
+	void build(const std::vector<Node*>& sceneNodes);
+	
+	/// updates the bounding boxes in the tree, after the nodes have moved (e.g., in Node::beginFrame()),
+	/// keeping its structure. Returns false if that's impossible (a node became bounded or unbounded),
+	/// and the tree must be rebuilt.
+	bool refit(void);
+	
+	/// finds the closest intersection of the ray with any of the nodes. The semantics of
+	/// `data' are the same as in Intersectable::findHit(), i.e. the surface data isn't filled in.
+	/// @returns the node that was hit, or NULL if nothing closer than data.dist was found
+	Node* intersect(const Ray& ray, IntersectionData& data);
+	
+	/// intersect() for a packet of rays (see Intersectable::findHitPacket()). The tree is traversed once for
+	/// the whole packet. For each ray in the packet, closestNode[i] is set to the node that was hit (it's left
+	/// unchanged, if nothing closer than data[i].dist was found).
+	void intersectPacket(const RayPacket& packet, IntersectionData data[], Node* closestNode[]);
+	
+	/// checks if the ray hits any of the nodes, closer than maxDist. Stops at the first
+	/// such intersection (see Intersectable::occluded()).
+	bool occluded(const Ray& ray, double maxDist);
+};
+
+#endif // __BVH_H__
@@ -21,8 +21,8 @@
 #include "camera.h"
 #include "matrix.h"
 #include "util.h"
-#include "sdl.h"
-#include "random_generator.h"
+#include "sampler.h"
+#include "bbox.h"
 
 void Camera::beginFrame(void)
 {
@@ -58,6 +58,9 @@ void Camera::beginFrame(void)
 	upLeft += pos;
 	upRight += pos;
 	downLeft += pos;
+	
+	frameW = scene.settings.frameWidth;
+	frameH = scene.settings.frameHeight;
 }
 
 Ray Camera::getScreenRay(double x, double y, int camera)
@@ -65,8 +68,8 @@ Ray Camera::getScreenRay(double x, double y, int camera)
 	Ray result; // A, B -     C = A + (B - A) * x
 	result.start = this->pos;
 	Vector target = upLeft + 
-		(upRight - upLeft) * (x / (double) frameWidth()) +
-		(downLeft - upLeft) * (y / (double) frameHeight());
+		(upRight - upLeft) * (x / frameW) +
+		(downLeft - upLeft) * (y / frameH);
 	
 	// A - camera; B = target
 	result.dir = target - this->pos;
@@ -85,9 +88,10 @@ Ray Camera::getScreenRay(double x, double y, int camera)
 	
 	Vector T = result.start + result.dir * M;
 	
-	Random& R = getRandomGen();
+	Sampler& sampler = getSampler();
 	double dx, dy;
-	R.unitDiscSample(dx, dy);
+	sampler.setDimension(SAMPLER_LENS);
+	sampler.unitDiscSample(dx, dy);
 	
 	dx *= discMultiplier;
 	dy *= discMultiplier;
@@ -101,6 +105,19 @@ Ray Camera::getScreenRay(double x, double y, int camera)
 	return result;
 }
 
+void Camera::getScreenRayPacket(int x, int y, int maxX, int maxY, RayPacket& packet)
+{
+	packet.mask = 0;
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		int px = x + i % PACKET_WIDTH;
+		int py = y + i / PACKET_WIDTH;
+		if (px >= maxX || py >= maxY) continue;
+		packet.rays[i] = RRay(getScreenRay(px, py));
+		packet.mask |= 1 << i;
+	}
+	packet.prepareForTracing();
+}
+
 void Camera::move(double dx, double dz)
 {
 	pos += dx * rightDir;
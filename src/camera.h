@@ -23,6 +23,8 @@
 #include "vector.h"
 #include "scene.h"
 
+struct RayPacket;
+
 enum {
 	CAMERA_CENTER,
 	CAMERA_LEFT,
@@ -34,6 +36,7 @@ class Camera: public SceneElement {
 	// ray shooting screen
 	Vector upLeft, upRight, downLeft;
 	Vector frontDir, rightDir, upDir;
+	double frameW, frameH; // the frame size in pixels, from the global settings
 public:
 	Vector pos; //!< position of the camera in 3D.
 	double yaw; //!< Yaw angle in degrees (rot. around the Y axis, meaningful values: [0..360])
@@ -77,6 +80,11 @@ public:
 	/// for use in stereoscopic rendering
 	Ray getScreenRay(double x, double y, int camera = CAMERA_CENTER);
 	
+	/// generates a packet of screen rays through the pixel block PACKET_WIDTH x PACKET_WIDTH with an upper-left corner
+	/// at (x, y); ray i goes through (x + i % PACKET_WIDTH, y + i / PACKET_WIDTH). Only the pixels with coordinates
+	/// less than (maxX, maxY) are used. The packet is prepared for tracing.
+	void getScreenRayPacket(int x, int y, int maxX, int maxY, RayPacket& packet);
+	
 	void move(double dx, double dz);
 	void rotate(double dx, double dz);
 };
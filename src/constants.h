@@ -21,7 +21,6 @@
 #define __CONSTANTS_H__
 
 
-#define VFB_MAX_SIZE 1920
 #define DEFAULT_RESOLUTION_WIDTH  640
 #define DEFAULT_RESOLUTION_HEIGHT 480
 #define PI 3.141592653589793238
@@ -29,6 +28,9 @@
 #define MAX_TRACE_DEPTH_DEFAULT 5
 #define MAX_TRIANGLES_PER_LEAF 20
 #define MAX_TREE_DEPTH         64
+#define KD_PARALLEL_BUILD_THRESHOLD 4096 // subtrees with at least that many triangles are built on separate threads
+#define PACKET_WIDTH 2 // ray packets cover PACKET_WIDTH x PACKET_WIDTH pixel blocks
+#define PACKET_SIZE  (PACKET_WIDTH * PACKET_WIDTH)
 
 // large `float' number:
 #define LARGE_FLOAT 1e17f
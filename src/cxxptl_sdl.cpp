@@ -44,6 +44,11 @@ int atomic_add(volatile int *addr, int val)
 	return InterlockedExchangeAdd((long*)addr, val);
 }
 
+bool atomic_cas_ptr(void* volatile *addr, void* expected, void* desired)
+{
+	return InterlockedCompareExchangePointer((PVOID volatile*) addr, desired, expected) == expected;
+}
+
 #else
 // !_WIN32:
 int atomic_add(volatile int *addr, int val)
@@ -56,6 +61,11 @@ int atomic_add(volatile int *addr, int val)
 	return val;
 }
 
+bool atomic_cas_ptr(void* volatile *addr, void* expected, void* desired)
+{
+	return __sync_bool_compare_and_swap(addr, expected, desired);
+}
+
 #endif
 
 #if defined __linux__ || defined unix
@@ -151,12 +161,8 @@ Event::~Event()
 void Event::wait(void)
 {
 	SDL_LockMutex(m);
-	if (state == 1) {
-		state = 0;
-		SDL_UnlockMutex(m);
-		return;
-	}
-	SDL_CondWait(c, m);
+	while (state == 0) // guard against spurious wakeups
+		SDL_CondWait(c, m);
 	state = 0;
 	SDL_UnlockMutex(m);
 }
@@ -214,11 +220,6 @@ void Barrier::checkout(void)
  @class ThreadPool
  **/
 
-void relent(void) // sleep off a bit
-{
-	SDL_Delay(10);
-}
-
 void my_thread_proc(ThreadInfoStruct*);
 int sdl_thread_proc(void* data)
 {
@@ -243,11 +244,12 @@ void ThreadPool::one_more_thread(void)
 {
 	ThreadInfoStruct& ti = info[active_count];
 	ti.thread_index = active_count;
-	ti.state = THREAD_CREATING;
+	// Events "save" their signals, so the new thread may be given work even before it
+	// has reached its wait(); thus we don't need to wait for it to start up:
+	ti.state = THREAD_SLEEPING;
 	ti.counter = &counter;
 	ti.thread_pool_event = &thread_pool_event;
 	ti.execute_class = NULL;
-	ti.waiting = &waiting;
 	new_thread(&ti.thread, &ti);
 	
 	++active_count;
@@ -255,83 +257,91 @@ void ThreadPool::one_more_thread(void)
 		info[i].thread_count = active_count;
 }
 
+/**
+ * A double-ended work queue of loop iterations. Its owner takes iterations from the front,
+ * others steal from the back. Once filled, the queue only shrinks, so it's just a range
+ * of positions in the `items' array.
+ */
+struct WorkQueue {
+	Mutex lock;
+	int* items;
+	int front, back;
+	
+	bool pop_front(int& item)
+	{
+		lock.enter();
+		bool result = front < back;
+		if (result) item = items[front++];
+		lock.leave();
+		return result;
+	}
+	bool pop_back(int& item)
+	{
+		lock.enter();
+		bool result = front < back;
+		if (result) item = items[--back];
+		lock.leave();
+		return result;
+	}
+};
+
 ThreadPool::ThreadPool()
 {
 	active_count = 0;
 	counter = 0;
 	m_n = -1;
+	queues = NULL;
+	queues_count = 0;
 }
 
 ThreadPool::~ThreadPool()
 {
 	killall_threads();
+	delete[] queues;
 }
 
 void ThreadPool::killall_threads(void)
 {
+	wait(); // in case of a pending run_async()
 	for (; active_count> 0; active_count --) {
 		ThreadInfoStruct& i = info[active_count-1];
-		while (i.state != THREAD_SLEEPING) relent();
 		i.state = THREAD_EXITING;
 		i.myevent.signal();
-		while (i.state != THREAD_DEAD) relent();
+		SDL_WaitThread(i.thread, NULL);
 	}
 }
 
-void ThreadPool::run(Parallel *para, int threads_count)
+void ThreadPool::dispatch(Parallel *para, int threads_count)
 {
-	if (threads_count == 1) {
-		para->entry(0, 1);
-		return;
-	}
 	while (active_count < threads_count) 
 		one_more_thread();
 	int n = threads_count;
-	m_n = -1;
 	
-	waiting = true;
 	counter = n;
 	for (int i = 0; i < n; i++) {
 		info[i].thread_index = i;
 		info[i].thread_count = n;
 		info[i].execute_class = para;
-		while (info[i].state != THREAD_SLEEPING) {
-			relent();
-		}
 		info[i].state = THREAD_RUNNING;
 		info[i].myevent.signal();
 	}
-	thread_pool_event.wait();
-	waiting = false;
-	
-	// round robin all threads until they come to rest
-	while (1) {
-		bool good = true;
-		for (int i = 0; i < n; i++) if (info[i].state != THREAD_SLEEPING) good = false;
-		if (good) break;
-		relent();
+}
+
+void ThreadPool::run(Parallel *para, int threads_count)
+{
+	if (threads_count == 1) {
+		para->entry(0, 1);
+		return;
 	}
+	m_n = -1;
+	dispatch(para, threads_count);
+	thread_pool_event.wait();
 }
 
 void ThreadPool::run_async(Parallel *para, int threads_count)
 {
-	while (active_count < threads_count) 
-		one_more_thread();
-	int n = threads_count;
-	m_n = n;
-	
-	waiting = true;
-	counter = n;
-	for (int i = 0; i < n; i++) {
-		info[i].thread_index = i;
-		info[i].thread_count = n;
-		info[i].execute_class = para;
-		while (info[i].state != THREAD_SLEEPING) {
-			relent();
-		}
-		info[i].state = THREAD_RUNNING;
-		info[i].myevent.signal();
-	}
+	m_n = threads_count;
+	dispatch(para, threads_count);
 }
 
 void ThreadPool::wait(void)
@@ -348,15 +358,6 @@ void ThreadPool::wait(void)
 		return;
 	}
 	thread_pool_event.wait();
-	waiting = false;
-	
-	// round robin all threads until they come to rest
-	while (1) {
-		bool good = true;
-		for (int i = 0; i < n; i++) if (info[i].state != THREAD_SLEEPING) good = false;
-		if (good) break;
-		relent();
-	}
 	m_n = -1; // prevent wait()ing again
 }
 
@@ -367,33 +368,74 @@ void ThreadPool::preload_threads(int count)
 		run(NULL, count);
 }
 
+class ParallelForTask: public Parallel {
+	ParallelFor *body;
+	WorkQueue* queues;
+	int* items;
+	volatile bool cancelled;
+public:
+	ParallelForTask(ParallelFor *body, int count, int threads_count, WorkQueue* queues):
+		body(body), queues(queues), cancelled(false)
+	{
+		// deal the iterations round-robin, so that queue #i gets i, i + n, i + 2n, ...:
+		items = new int[count];
+		int pos = 0;
+		for (int i = 0; i < threads_count; i++) {
+			queues[i].items = items;
+			queues[i].front = pos;
+			for (int j = i; j < count; j += threads_count)
+				items[pos++] = j;
+			queues[i].back = pos;
+		}
+	}
+	~ParallelForTask() { delete[] items; }
+	
+	void entry(int thread_index, int threads_count)
+	{
+		int index;
+		while (!cancelled) {
+			if (!queues[thread_index].pop_front(index)) {
+				// our queue is empty: try stealing from the others, starting with our neighbour:
+				bool found = false;
+				for (int i = 1; i < threads_count && !found; i++)
+					found = queues[(thread_index + i) % threads_count].pop_back(index);
+				if (!found) break; // no work left anywhere (and no new work ever appears)
+			}
+			if (!body->process(index, thread_index))
+				cancelled = true;
+		}
+	}
+};
+
+void ThreadPool::parallel_for(int count, ParallelFor *body, int threads_count)
+{
+	if (threads_count > count) threads_count = count;
+	if (threads_count < 1) return;
+	if (threads_count > MAX_CPU_COUNT) threads_count = MAX_CPU_COUNT;
+	// the queues (and their mutexes) are created once, and reused by the subsequent loops:
+	if (queues_count < threads_count) {
+		delete[] queues;
+		queues = new WorkQueue[threads_count];
+		queues_count = threads_count;
+	}
+	ParallelForTask task(body, count, threads_count, queues);
+	run(&task, threads_count);
+}
+
 
 /**
  thread function (my_thread_proc)
  **/
 void my_thread_proc(ThreadInfoStruct *info)
 {
-	bool she = false;
-	do {
-
-		info->state = THREAD_SLEEPING;
+	while (true) {
 		info->myevent.wait();
-		switch (info->state) {
-			case THREAD_EXITING: she = true; break;
-			case THREAD_RUNNING:
-			{
-				if (info->execute_class) info->execute_class->entry(info->thread_index, info->thread_count);
-				int res = --(*(info->counter));
-				if (!res) {
-					info->thread_pool_event->signal();
-					do {
-						relent();
-					} while (*(info->waiting));
-				}
-				break;
-			}
-			default: break;
-		}
-	} while (!she);
+		if (info->state == THREAD_EXITING) break;
+		if (info->execute_class) info->execute_class->entry(info->thread_index, info->thread_count);
+		info->state = THREAD_SLEEPING;
+		// the last one to finish wakes the boss:
+		if (--(*(info->counter)) == 0)
+			info->thread_pool_event->signal();
+	}
 	info->state = THREAD_DEAD;
 }
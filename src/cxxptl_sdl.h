@@ -87,6 +87,13 @@ void multithreaded_memset(void *data, unsigned fill_pattern, long size, int thre
 */
 int atomic_add(volatile int *addr, int val);
 
+/**
+ * atomic_cas_ptr
+ * If the pointer at `addr' is equal to `expected', replaces it with `desired', in an interlocked
+ * operation. Returns true if the replacement took place.
+*/
+bool atomic_cas_ptr(void* volatile *addr, void* expected, void* desired);
+
 //
 // OK, the classes next
 //
@@ -108,6 +115,52 @@ public:
 	inline int add(int value) { return atomic_add(&data, value); }
 };
 
+/**
+ * @class LockFreeList
+ * @brief A lock-free queue with many producers and a single consumer
+ *
+ * Any thread may push() items into the list, without ever blocking. The consumer
+ * takes all of the pushed items at once with take_all(), and becomes their owner.
+ * The items are chained through their `next' member, i.e., T must have a `T* next'.
+ *
+ * As items are never removed one by one, the list isn't prone to the ABA problem.
+*/
+template <class T>
+class LockFreeList {
+	void* volatile head;
+	LockFreeList(const LockFreeList& rhs); // non-copyable class...
+	LockFreeList& operator = (const LockFreeList& rhs); // ... disallow evil constructors
+public:
+	LockFreeList(): head(0) {}
+	
+	void push(T* item)
+	{
+		void* old;
+		do {
+			old = head;
+			item->next = static_cast<T*>(old);
+		} while (!atomic_cas_ptr(&head, old, item));
+	}
+	
+	/// takes all items, in the order they were pushed (a linked list through `next'; NULL if the list was empty)
+	T* take_all(void)
+	{
+		void* old;
+		do {
+			old = head;
+		} while (old && !atomic_cas_ptr(&head, old, 0));
+		// the chain is in reverse order (newest first); reverse it:
+		T *result = 0, *p = static_cast<T*>(old);
+		while (p) {
+			T* next = p->next;
+			p->next = result;
+			result = p;
+			p = next;
+		}
+		return result;
+	}
+};
+
 /**
  * @class Mutex
  * @brief MUTual EXclusive device
@@ -257,7 +310,26 @@ struct ThreadInfoStruct {
 	volatile ThreadState state;
 	Parallel *execute_class;
 	InterlockedInt *counter;
-	bool volatile * waiting;
+};
+
+/**
+ * @class ParallelFor
+ * @brief The body of a parallel loop (@see ThreadPool::parallel_for)
+ *
+ * Derive from it and put the work for a single iteration (e.g., rendering
+ * a single bucket) in process().
+*/
+class ParallelFor {
+public:
+	/**
+	 * Process a single iteration of the loop
+	 * @param index        - the iteration index, 0..count-1;
+	 * @param thread_index - the worker, which is running it, 0..threads_count-1.
+	 * @returns true to continue, false to cancel the whole loop (iterations, which
+	 *          are already running, are not interrupted, but no new are started).
+	*/
+	virtual bool process(int index, int thread_index) = 0;
+	virtual ~ParallelFor() {}
 };
 
 /**
@@ -290,14 +362,18 @@ struct ThreadInfoStruct {
  * In the example, get_processor_count() is used to determine the optimal
  * number of threads to spawn.
 */ 
+struct WorkQueue;
+
 class ThreadPool {
 	ThreadInfoStruct info[MAX_CPU_COUNT];
 	int active_count, m_n;
 	InterlockedInt counter;
 	Event thread_pool_event;
-	volatile bool waiting;
+	WorkQueue* queues; // the per-thread work queues of parallel_for(); kept between calls
+	int queues_count;
 	
 	void one_more_thread(void);
+	void dispatch(Parallel *what, int threads_count);
 	ThreadPool(const ThreadPool& rhs); // non-copyable class...
 	ThreadPool& operator = (const ThreadPool& rhs); // ... disallow evil constructors
 public:
@@ -318,6 +394,22 @@ public:
 	 * created or used; the method just calls what->entry(0, 1) and returns.
 	*/ 
 	void run(Parallel *what, int threads_count);
+	
+	/**
+	 * @param count         - the number of iterations;
+	 * @param body          - what to do on each iteration;
+	 * @param threads_count - on how many threads to run the loop.
+	 *
+	 * parallel_for() calls body->process(i, ...) for each i in 0..count-1 and
+	 * returns when all of them are done (or the loop is cancelled).
+	 *
+	 * The iterations are dealt round-robin to per-thread work queues, so each thread
+	 * starts in the beginning of the range and iterations are started roughly in
+	 * their order. A thread which has emptied its own queue steals from the back of
+	 * the other threads' queues, so the load stays balanced even if some iterations
+	 * are much heavier than others.
+	*/
+	void parallel_for(int count, ParallelFor *body, int threads_count);
 
 	/**
 	 * @param what          - the algorithm to run;
@@ -354,6 +446,10 @@ public:
 	void killall_threads(void);
 };
 
+/// the application's thread pool: the rendering threads, also used for other parallel work (e.g., building
+/// KD-trees). It's defined by the application (in main.cpp)
+extern ThreadPool threadPool;
+
 /// platform dependant procedure to create a new thread
 void new_thread(ThreadID* handle, ThreadInfoStruct *);
 
@@ -0,0 +1,343 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <deque>
+#include "distributed.h"
+#include "framebuffer.h"
+#include "scene.h"
+#include "sdl.h"
+#include "util.h"
+
+#ifdef _WIN32
+
+void initDistributed(const char* argv0)
+{
+}
+
+bool renderDistributed(const char* sceneFile, int numWorkers, int workerThreads)
+{
+	printf("Distributed rendering is not supported on this platform\n");
+	return false;
+}
+
+void initWorker(void)
+{
+}
+
+int runWorker(void)
+{
+	printf("Distributed rendering is not supported on this platform\n");
+	return 1;
+}
+
+#else
+// !_WIN32:
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+using std::vector;
+using std::deque;
+
+extern FrameBuffer vfb; // from main.cpp
+extern void renderBucket(const Rect& r); // from main.cpp
+
+/// A work unit, as sent to the worker. The worker replies with the same struct, followed
+/// by the pixels of the rectangle, as float RGB triples, row by row.
+struct WorkUnit {
+	int index; //!< index of the bucket in the coordinator's list
+	int x0, y0, x1, y1;
+};
+
+static char workerExecutable[PATH_MAX] = "trinity"; //!< how to start a worker; see initDistributed()
+
+void initDistributed(const char* argv0)
+{
+	if (!argv0 || !argv0[0]) return;
+	// a bare name was found in $PATH, and execvp() will find it there again. A path is made
+	// absolute, so it still works if the current directory changes:
+	if (!strchr(argv0, '/') || !realpath(argv0, workerExecutable)) {
+		strncpy(workerExecutable, argv0, sizeof(workerExecutable) - 1);
+		workerExecutable[sizeof(workerExecutable) - 1] = 0;
+	}
+}
+
+static const int MAX_ATTEMPTS = 3; //!< how many times a unit is tried, before the whole render is given up
+
+/// reads exactly `size' bytes (blocking). Returns false on EOF or error
+static bool readAll(int fd, void* buff, size_t size)
+{
+	char* p = (char*) buff;
+	while (size > 0) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+/// writes exactly `size' bytes. Returns false on error
+static bool writeAll(int fd, const void* buff, size_t size)
+{
+	const char* p = (const char*) buff;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+struct Worker {
+	pid_t pid;      //!< -1 if the worker isn't running
+	int toWorker;   //!< the worker's stdin
+	int fromWorker; //!< the worker's stdout (non-blocking)
+	int unit;       //!< the unit being rendered, or -1 if idle
+	vector<char> reply; //!< the reply for `unit' (a WorkUnit, followed by the pixels)...
+	size_t received;    //!< ... and how much of it has arrived so far
+	double deadline;    //!< when the reply must be complete (see GlobalSettings::workerTimeout)
+	Worker(): pid(-1), toWorker(-1), fromWorker(-1), unit(-1), received(0), deadline(0) {}
+};
+
+/// reads whatever part of the worker's reply has already arrived, without blocking.
+/// Returns false on EOF or error
+static bool receiveReply(Worker& w)
+{
+	while (w.received < w.reply.size()) {
+		ssize_t n = read(w.fromWorker, &w.reply[w.received], w.reply.size() - w.received);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true; // the rest is yet to come
+		if (n <= 0) return false;
+		w.received += n;
+	}
+	return true;
+}
+
+static bool startWorker(Worker& w, const char* sceneFile, int threads)
+{
+	int in[2], out[2];
+	if (pipe(in)) return false;
+	if (pipe(out)) {
+		close(in[0]);
+		close(in[1]);
+		return false;
+	}
+	// our ends of the pipes must not leak into the other workers:
+	fcntl(in[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	// a stalled worker must not block us in the middle of a reply; it's timed out instead:
+	fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+	char threadsStr[16];
+	sprintf(threadsStr, "%d", threads);
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(in[0]); close(in[1]);
+		close(out[0]); close(out[1]);
+		return false;
+	}
+	if (pid == 0) {
+		// the child: run another instance of ourselves in worker mode
+		dup2(in[0], 0);
+		dup2(out[1], 1);
+		close(in[0]); close(in[1]);
+		close(out[0]); close(out[1]);
+		char* args[] = { workerExecutable, (char*) "--worker", threadsStr, (char*) sceneFile, NULL };
+		execvp(workerExecutable, args);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	w.pid = pid;
+	w.toWorker = in[1];
+	w.fromWorker = out[0];
+	w.unit = -1;
+	return true;
+}
+
+/// stops a worker. If `kill' is false, the worker is let to exit normally (it does so, when its stdin is closed).
+/// Otherwise it's sent SIGKILL, as a hung (or stopped) worker may never act on SIGTERM
+static void stopWorker(Worker& w, bool kill)
+{
+	if (w.pid < 0) return;
+	close(w.toWorker);
+	close(w.fromWorker);
+	if (kill) ::kill(w.pid, SIGKILL);
+	waitpid(w.pid, NULL, 0);
+	w.pid = -1;
+	w.unit = -1;
+}
+
+bool renderDistributed(const char* sceneFile, int numWorkers, int workerThreads)
+{
+	signal(SIGPIPE, SIG_IGN); // a dead worker should produce a write error, not kill us
+	
+	vector<Rect> buckets = getBucketsList(scene.settings.bucketSize);
+	deque<int> pending;
+	for (int i = 0; i < (int) buckets.size(); i++)
+		pending.push_back(i);
+	vector<int> attempts(buckets.size(), 0);
+	
+	vector<Worker> workers(numWorkers);
+	int respawnsLeft = numWorkers * MAX_ATTEMPTS; // how many lost workers may be replaced
+	for (int i = 0; i < numWorkers; i++)
+		if (!startWorker(workers[i], sceneFile, workerThreads))
+			printf("Cannot start worker #%d\n", i);
+	
+	bool ok = true;
+	int done = 0;
+	
+	// a worker died (or misbehaved, or timed out): give its unit to someone else
+	auto lostWorker = [&](Worker& w) {
+		int unit = w.unit;
+		printf("Worker (pid %d) lost\n", (int) w.pid);
+		stopWorker(w, true);
+		if (attempts[unit] >= MAX_ATTEMPTS) {
+			printf("Bucket #%d failed %d times; giving up\n", unit, attempts[unit]);
+			ok = false;
+		} else {
+			pending.push_front(unit);
+		}
+	};
+	
+	while (ok && done < (int) buckets.size()) {
+		// deal units to the idle workers (and replace the lost ones):
+		for (int i = 0; i < numWorkers && ok; i++) {
+			Worker& w = workers[i];
+			if (pending.empty()) break;
+			if (w.pid < 0) {
+				if (respawnsLeft <= 0 || !startWorker(w, sceneFile, workerThreads)) continue;
+				respawnsLeft--;
+			}
+			if (w.unit >= 0) continue;
+			int index = pending.front();
+			pending.pop_front();
+			const Rect& r = buckets[index];
+			WorkUnit wu = { index, r.x0, r.y0, r.x1, r.y1 };
+			w.unit = index;
+			w.reply.resize(sizeof(WorkUnit) + r.w * r.h * 3 * sizeof(float));
+			w.received = 0;
+			w.deadline = getPreciseTime() + scene.settings.workerTimeout;
+			attempts[index]++;
+			if (!writeAll(w.toWorker, &wu, sizeof(wu)))
+				lostWorker(w);
+		}
+		if (!ok) break;
+		
+		// wait for some of the busy workers to reply:
+		vector<pollfd> fds;
+		vector<int> owners;
+		for (int i = 0; i < numWorkers; i++) {
+			if (workers[i].pid < 0 || workers[i].unit < 0) continue;
+			pollfd pfd = { workers[i].fromWorker, POLLIN, 0 };
+			fds.push_back(pfd);
+			owners.push_back(i);
+		}
+		if (fds.empty()) {
+			printf("No worker processes left\n");
+			ok = false;
+			break;
+		}
+		if (poll(&fds[0], fds.size(), 100) < 0 && errno != EINTR) {
+			ok = false;
+			break;
+		}
+		double now = getPreciseTime();
+		for (int j = 0; j < (int) fds.size() && ok; j++) {
+			Worker& w = workers[owners[j]];
+			if (fds[j].revents && !receiveReply(w)) {
+				lostWorker(w);
+				continue;
+			}
+			if (w.received < w.reply.size()) {
+				if (now > w.deadline) {
+					printf("Worker (pid %d) timed out on bucket #%d\n", (int) w.pid, w.unit);
+					lostWorker(w);
+				}
+				continue;
+			}
+			const Rect& r = buckets[w.unit];
+			WorkUnit wu;
+			memcpy(&wu, &w.reply[0], sizeof(wu));
+			if (wu.index != w.unit) {
+				lostWorker(w);
+				continue;
+			}
+			const float* p = (const float*) &w.reply[sizeof(wu)];
+			for (int y = r.y0; y < r.y1; y++)
+				for (int x = r.x0; x < r.x1; x++, p += 3)
+					vfb[y][x] = Color(p[0], p[1], p[2]);
+			w.unit = -1;
+			done++;
+			if (!displayVFBRect(r, vfb)) ok = false; // interrupted
+		}
+	}
+	
+	for (int i = 0; i < numWorkers; i++)
+		stopWorker(workers[i], !ok);
+	return ok;
+}
+
+static int workerOutput = -1; //!< the worker's original stdout
+
+void initWorker(void)
+{
+	fflush(stdout);
+	workerOutput = dup(1);
+	dup2(2, 1);
+}
+
+int runWorker(void)
+{
+	int out = workerOutput;
+	WorkUnit wu;
+	vector<float> pixels;
+	while (readAll(0, &wu, sizeof(wu))) {
+		Rect r(wu.x0, wu.y0, wu.x1, wu.y1);
+		if (r.x0 < 0 || r.y0 < 0 || r.x1 > frameWidth() || r.y1 > frameHeight() || r.w <= 0 || r.h <= 0) {
+			printf("Worker: bad work unit (%d, %d)-(%d, %d)\n", r.x0, r.y0, r.x1, r.y1);
+			return 1;
+		}
+		renderBucket(r);
+		pixels.clear();
+		for (int y = r.y0; y < r.y1; y++)
+			for (int x = r.x0; x < r.x1; x++) {
+				pixels.push_back(vfb[y][x].r);
+				pixels.push_back(vfb[y][x].g);
+				pixels.push_back(vfb[y][x].b);
+			}
+		if (!writeAll(out, &wu, sizeof(wu)) || !writeAll(out, &pixels[0], pixels.size() * sizeof(float)))
+			return 1;
+	}
+	return 0;
+}
+
+#endif // _WIN32
@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+/**
+ * Distributed rendering: a coordinator process splits the frame into work units (the buckets from
+ * getBucketsList()) and deals them to a number of worker processes. The workers are other instances
+ * of trinity, started as `trinity --worker <threads> <scenefile>'; they talk to the coordinator
+ * through their stdin (work units in) and stdout (float RGB pixels out).
+ *
+ * If a worker dies, its unit is given to another worker and a replacement worker is started.
+ * Currently the workers are always started on the local machine (POSIX only), from the
+ * same executable as the coordinator.
+ */
+
+/// Remembers the executable, given as argv[0], so that the workers can be started from it.
+/// Must be called at startup, before the current directory is changed.
+void initDistributed(const char* argv0);
+
+/// Renders the frame in vfb, using `numWorkers' worker processes with `workerThreads' threads each.
+/// Finished units are displayed as they arrive. Returns false if the render failed or was interrupted.
+bool renderDistributed(const char* sceneFile, int numWorkers, int workerThreads);
+
+/// Reserves stdout for the results of a worker process; anything printed afterwards goes to stderr.
+/// Must be called before anything is printed.
+void initWorker(void);
+
+/// The main loop of a worker process: renders the work units that come on stdin, until it is closed.
+/// The scene must be already loaded and prepared for rendering. Returns the process exit code.
+int runWorker(void);
+
+#endif // __DISTRIBUTED_H__
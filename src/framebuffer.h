@@ -0,0 +1,63 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef __FRAMEBUFFER_H__
+#define __FRAMEBUFFER_H__
+
+#include "color.h"
+
+/**
+ * @brief A 2D array of per-pixel values, allocated on the heap, in row-major order
+ *
+ * Pixels are accessed like in a plain 2D array, i.e. buff[y][x].
+ */
+template <class T>
+class Array2D {
+	T* data;
+	int width, height;
+	Array2D(const Array2D& rhs); // non-copyable class...
+	Array2D& operator = (const Array2D& rhs); // ... disallow evil constructors
+public:
+	Array2D(): data(0), width(0), height(0) {}
+	~Array2D() { delete[] data; }
+	
+	/// (re)allocates the array for the given dimensions. The contents are undefined; use clear()
+	void resize(int newWidth, int newHeight)
+	{
+		delete[] data;
+		width = newWidth;
+		height = newHeight;
+		data = new T[width * height];
+	}
+	
+	void clear(const T& value) //!< sets all values to `value'
+	{
+		for (int i = 0; i < width * height; i++) data[i] = value;
+	}
+	
+	int getWidth(void) const { return width; }
+	int getHeight(void) const { return height; }
+	
+	inline T* operator[] (int y) { return data + y * width; }
+	inline const T* operator[] (int y) const { return data + y * width; }
+};
+
+typedef Array2D<Color> FrameBuffer; //!< a virtual framebuffer, holding the linear, unclamped float RGB of each pixel
+
+#endif // __FRAMEBUFFER_H__
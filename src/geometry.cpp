@@ -27,6 +27,13 @@ using std::vector;
 
 
 bool Plane::intersect(const Ray& ray, IntersectionData& data)
+{
+	if (!findHit(ray, data)) return false;
+	fillSurfaceData(ray, data);
+	return true;
+}
+
+bool Plane::findHit(const Ray& ray, IntersectionData& data)
 {
 	// intersect a ray with a XZ plane:
 	// if the ray is pointing to the horizon, or "up", but the plane is below us,
@@ -44,20 +51,48 @@ bool Plane::intersect(const Ray& ray, IntersectionData& data)
 		Vector p = ray.start + ray.dir * mult;
 		if (fabs(p.x) > limit || fabs(p.z) > limit) return false;
 		
-		// calculate intersection:
-		data.p = p;
 		data.dist = mult;
-		data.normal = Vector(0, 1, 0);
-		data.dNdx = Vector(1, 0, 0);
-		data.dNdy = Vector(0, 0, 1);
-		data.u = data.p.x;
-		data.v = data.p.z;
 		data.g = this;
 		return true;
 	}
 }
 
+void Plane::fillSurfaceData(const Ray& ray, IntersectionData& data)
+{
+	data.p = ray.start + ray.dir * data.dist;
+	data.normal = Vector(0, 1, 0);
+	data.dNdx = Vector(1, 0, 0);
+	data.dNdy = Vector(0, 0, 1);
+	data.u = data.p.x;
+	data.v = data.p.z;
+}
+
+bool Plane::occluded(const Ray& ray, double maxDist)
+{
+	if ((ray.start.y > y && ray.dir.y > -1e-9) || (ray.start.y < y && ray.dir.y < 1e-9))
+		return false;
+	double mult = (ray.start.y - this->y) / -ray.dir.y;
+	if (mult > maxDist) return false;
+	Vector p = ray.start + ray.dir * mult;
+	return fabs(p.x) <= limit && fabs(p.z) <= limit;
+}
+
+bool Plane::getBBox(BBox& box) const
+{
+	if (limit >= INF) return false; // an infinite plane
+	box.vmin.set(-limit, y, -limit);
+	box.vmax.set(+limit, y, +limit);
+	return true;
+}
+
 bool Sphere::intersect(const Ray& ray, IntersectionData& info)
+{
+	if (!findHit(ray, info)) return false;
+	fillSurfaceData(ray, info);
+	return true;
+}
+
+bool Sphere::findHit(const Ray& ray, IntersectionData& info)
 {
 	// compute the sphere intersection using a quadratic equation:
 	Vector H = ray.start - center;
@@ -77,7 +112,13 @@ bool Sphere::intersect(const Ray& ray, IntersectionData& info)
 	if (sol > info.dist) return false;
 	
 	info.dist = sol;
-	info.p = ray.start + ray.dir * sol;
+	info.g = this;
+	return true;
+}
+
+void Sphere::fillSurfaceData(const Ray& ray, IntersectionData& info)
+{
+	info.p = ray.start + ray.dir * info.dist;
 	info.normal = info.p - center; // generate the normal by getting the direction from the center to the ip
 	info.normal.normalize();
 	double angle = atan2(info.p.z - center.z, info.p.x - center.x);
@@ -85,11 +126,32 @@ bool Sphere::intersect(const Ray& ray, IntersectionData& info)
 	info.v = 1.0 - (PI/2 + asin((info.p.y - center.y)/R)) / PI;
 	info.dNdx = Vector(cos(angle + PI/2), 0, sin(angle + PI/2));
 	info.dNdy = info.dNdx ^ info.normal;
-	info.g = this;
+}
+
+bool Sphere::occluded(const Ray& ray, double maxDist)
+{
+	// same as intersect(), but without computing the intersection data:
+	Vector H = ray.start - center;
+	double A = ray.dir.lengthSqr();
+	double B = 2 * dot(H, ray.dir);
+	double C = H.lengthSqr() - R*R;
+	double Dscr = B*B - 4*A*C;
+	if (Dscr < 0) return false;
+	double sol = (-B - sqrt(Dscr)) / (2*A);
+	if (sol < 0) sol = (-B + sqrt(Dscr)) / (2*A);
+	return sol >= 0 && sol <= maxDist;
+}
+
+bool Sphere::getBBox(BBox& box) const
+{
+	box.vmin = center - Vector(R, R, R);
+	box.vmax = center + Vector(R, R, R);
 	return true;
 }
 
-inline bool Cube::intersectCubeSide(const Ray& ray, const Vector& center, IntersectionData& data)
+// checks the two sides of the cube, perpendicular to the Y axis. `sides' is the index of the first of them
+// (the primitive index, stored on a hit; see fillSurfaceData())
+inline bool Cube::intersectCubeSide(const Ray& ray, const Vector& center, IntersectionData& data, int sides)
 {
 	if (fabs(ray.dir.y) < 1e-9) return false;
 
@@ -106,40 +168,91 @@ inline bool Cube::intersectCubeSide(const Ray& ray, const Vector& center, Inters
 			p.x > center.x + halfSide ||
 			p.z < center.z - halfSide ||
 			p.z > center.z + halfSide) continue;
-		data.p = ray.start + ray.dir * mult;
 		data.dist = mult;
-		data.normal = Vector(0, side, 0);
-		data.dNdx = Vector(1, 0, 0);
-		data.dNdy = Vector(0, 0, side);
-		data.u = data.p.x - center.x;
-		data.v = data.p.z - center.z;
+		data.primitive = sides + (side > 0);
 		found = true;	
 	}
 	return found;
 }
 
 bool Cube::intersect(const Ray& ray, IntersectionData& data)
+{
+	if (!findHit(ray, data)) return false;
+	fillSurfaceData(ray, data);
+	return true;
+}
+
+bool Cube::findHit(const Ray& ray, IntersectionData& data)
 {
 	// check for intersection with the negative Y and positive Y sides
-	bool found = intersectCubeSide(ray, center, data);
+	bool found = intersectCubeSide(ray, center, data, 0);
 	
 	// check for intersection with the negative X and positive X sides
-	if (intersectCubeSide(project(ray, 1, 0, 2), project(center, 1, 0, 2), data)) {
+	if (intersectCubeSide(project(ray, 1, 0, 2), project(center, 1, 0, 2), data, 2))
 		found = true;
-		data.normal = unproject(data.normal, 1, 0, 2);
-		data.p = unproject(data.p, 1, 0, 2);
-	}
 
 	// check for intersection with the negative Z and positive Z sides
-	if (intersectCubeSide(project(ray, 0, 2, 1), project(center, 0, 2, 1), data)) {
+	if (intersectCubeSide(project(ray, 0, 2, 1), project(center, 0, 2, 1), data, 4))
 		found = true;
-		data.normal = unproject(data.normal, 0, 2, 1);
-		data.p = unproject(data.p, 0, 2, 1);
-	}
 	if (found) data.g = this;
 	return found;
 }
 
+void Cube::fillSurfaceData(const Ray& ray, IntersectionData& data)
+{
+	int side = (data.primitive & 1) ? +1 : -1;
+	data.p = ray.start + ray.dir * data.dist;
+	data.dNdx = Vector(1, 0, 0);
+	data.dNdy = Vector(0, 0, side);
+	switch (data.primitive / 2) {
+		case 0: // the Y sides
+			data.normal = Vector(0, side, 0);
+			data.u = data.p.x - center.x;
+			data.v = data.p.z - center.z;
+			break;
+		case 1: // the X sides
+			data.normal = Vector(side, 0, 0);
+			data.u = data.p.y - center.y;
+			data.v = data.p.z - center.z;
+			break;
+		default: // the Z sides
+			data.normal = Vector(0, 0, side);
+			data.u = data.p.x - center.x;
+			data.v = data.p.y - center.y;
+			break;
+	}
+}
+
+bool Cube::occluded(const Ray& ray, double maxDist)
+{
+	// find where the ray enters and leaves the cube (the "slab" test):
+	double halfSide = side * 0.5;
+	double tNear = -INF, tFar = INF;
+	for (int dim = 0; dim < 3; dim++) {
+		if (fabs(ray.dir[dim]) < 1e-9) {
+			if (fabs(ray.start[dim] - center[dim]) > halfSide) return false;
+			continue;
+		}
+		double t0 = (center[dim] - halfSide - ray.start[dim]) / ray.dir[dim];
+		double t1 = (center[dim] + halfSide - ray.start[dim]) / ray.dir[dim];
+		if (t0 > t1) std::swap(t0, t1);
+		tNear = std::max(tNear, t0);
+		tFar = std::min(tFar, t1);
+		if (tNear > tFar) return false;
+	}
+	// if we're outside, we hit the cube's surface at tNear, otherwise (when inside) - at tFar:
+	double t = tNear >= 0 ? tNear : tFar;
+	return t >= 0 && t <= maxDist;
+}
+
+bool Cube::getBBox(BBox& box) const
+{
+	double halfSide = side * 0.5;
+	box.vmin = center - Vector(halfSide, halfSide, halfSide);
+	box.vmax = center + Vector(halfSide, halfSide, halfSide);
+	return true;
+}
+
 // find all intersections of a ray with a geometry, storing the intersection points in the vector `l'
 void CsgOp::findAllIntersections(Geometry* geom, Ray ray, vector<IntersectionData>& l)
 {
@@ -153,7 +266,7 @@ void CsgOp::findAllIntersections(Geometry* geom, Ray ray, vector<IntersectionDat
 		temp.dist += currentLength;
 		currentLength = temp.dist;
 		l.push_back(temp);
-		ray.start = temp.p + ray.dir * 1e-6;
+		ray.start = temp.p + ray.dir * surfaceEpsilon(temp.p);
 	}
 }
 
@@ -197,6 +310,15 @@ bool CsgOp::intersect(const Ray& ray, IntersectionData& data)
 	return false;
 }
 
+bool CsgOp::getBBox(BBox& box) const
+{
+	// the union of the two boxes is a conservative estimate for all boolean operations:
+	BBox rightBox;
+	if (!left->getBBox(box) || !right->getBBox(rightBox)) return false;
+	box.add(rightBox);
+	return true;
+}
+
 bool CsgDiff::intersect(const Ray& ray, IntersectionData& data)
 {
 	if (!CsgOp::intersect(ray, data)) return false;
@@ -209,11 +331,111 @@ bool CsgDiff::intersect(const Ray& ray, IntersectionData& data)
 	 *
 	 * Solution: when we detect a situation like this, we flip the normals.
 	 */
-	 if (right->isInside(data.p - ray.dir * 1e-6) != right->isInside(data.p + ray.dir * 1e-6))
+	 if (right->isInside(data.p - ray.dir * surfaceEpsilon(data.p)) != right->isInside(data.p + ray.dir * surfaceEpsilon(data.p)))
 		data.normal = -data.normal;
 	 return true;
 }
 
+bool Node::getBBox(BBox& box) const
+{
+	BBox canonic;
+	if (!geom->getBBox(canonic)) return false;
+	// transform all the eight corners of the canonic box to world space, and enclose them:
+	box.makeEmpty();
+	for (int mask = 0; mask < 8; mask++) {
+		Vector corner(
+			(mask & 1) ? canonic.vmax.x : canonic.vmin.x,
+			(mask & 2) ? canonic.vmax.y : canonic.vmin.y,
+			(mask & 4) ? canonic.vmax.z : canonic.vmin.z
+		);
+		box.add(transform.point(corner));
+	}
+	return true;
+}
+
+// the any-hit counterpart of Node::intersect() (see the explanation there for the distance scaling)
+bool Node::occluded(const Ray& ray, double maxDist)
+{
+	Ray rayCanonic;
+	rayCanonic.start = transform.undoPoint(ray.start);
+	rayCanonic.dir = transform.undoDirection(ray.dir);
+	rayCanonic.flags = ray.flags;
+	rayCanonic.depth = ray.depth;
+	double rayDirLength = rayCanonic.dir.length();
+	rayCanonic.dir.normalize();
+	return geom->occluded(rayCanonic, maxDist * rayDirLength);
+}
+
+// the same as Node::intersect(), but only calls the geometry's findHit()
+bool Node::findHit(const Ray& ray, IntersectionData& data)
+{
+	Ray rayCanonic;
+	rayCanonic.start = transform.undoPoint(ray.start);
+	rayCanonic.dir = transform.undoDirection(ray.dir);
+	rayCanonic.flags = ray.flags;
+	rayCanonic.depth = ray.depth;
+	
+	double oldDist = data.dist;
+	double rayDirLength = rayCanonic.dir.length();
+	data.dist *= rayDirLength;
+	rayCanonic.dir.normalize();
+	if (!geom->findHit(rayCanonic, data)) {
+		data.dist = oldDist;
+		return false;
+	}
+	data.dist /= rayDirLength;
+	return true;
+}
+
+// findHit() for a packet: all rays are transformed to the canonic space, and traced there together
+int Node::findHitPacket(const RayPacket& packet, IntersectionData data[], int mask)
+{
+	RayPacket packetCanonic;
+	packetCanonic.mask = mask;
+	double oldDist[PACKET_SIZE], rayDirLength[PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; i++) if (mask & (1 << i)) {
+		const Ray& ray = packet.rays[i];
+		RRay& rayCanonic = packetCanonic.rays[i];
+		rayCanonic.start = transform.undoPoint(ray.start);
+		rayCanonic.dir = transform.undoDirection(ray.dir);
+		rayCanonic.flags = ray.flags;
+		rayCanonic.depth = ray.depth;
+		oldDist[i] = data[i].dist;
+		rayDirLength[i] = rayCanonic.dir.length();
+		data[i].dist *= rayDirLength[i];
+		rayCanonic.dir.normalize();
+	}
+	packetCanonic.prepareForTracing();
+	int found = geom->findHitPacket(packetCanonic, data, mask);
+	for (int i = 0; i < PACKET_SIZE; i++) if (mask & (1 << i)) {
+		if (found & (1 << i))
+			data[i].dist /= rayDirLength[i];
+		else
+			data[i].dist = oldDist[i];
+	}
+	return found;
+}
+
+// completes a findHit(): fills the surface data in the canonic space, and then converts it to world space
+void Node::fillSurfaceData(const Ray& ray, IntersectionData& data)
+{
+	Ray rayCanonic;
+	rayCanonic.start = transform.undoPoint(ray.start);
+	rayCanonic.dir = transform.undoDirection(ray.dir);
+	rayCanonic.flags = ray.flags;
+	rayCanonic.depth = ray.depth;
+	
+	double rayDirLength = rayCanonic.dir.length();
+	data.dist *= rayDirLength;
+	rayCanonic.dir.normalize();
+	geom->fillSurfaceData(rayCanonic, data);
+	data.normal = normalize(transform.normal(data.normal));
+	data.dNdx = normalize(transform.direction(data.dNdx));
+	data.dNdy = normalize(transform.direction(data.dNdy));
+	data.p = transform.point(data.p);
+	data.dist /= rayDirLength;
+}
+
 // intersect a ray with a node, considering the Model transform attached to the node.
 bool Node::intersect(const Ray& ray, IntersectionData& data)
 {
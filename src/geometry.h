@@ -24,6 +24,7 @@
 #include "vector.h"
 #include "scene.h"
 #include "transform.h"
+#include "bbox.h"
 
 /// a structure, that holds info about an intersection. Filled in by Geometry::intersect() methods
 class Geometry;
@@ -31,11 +32,15 @@ struct IntersectionData {
 	Vector p; //!< intersection point in the world-space
 	Vector normal; //!< the normal of the geometry at the intersection point
 	Vector dNdx, dNdy; 
-	double dist; //!< before intersect(): the max dist to look for intersection; after intersect() - the distance found
+	real dist; //!< before intersect(): the max dist to look for intersection; after intersect() - the distance found
 	
-	double u, v; //!< 2D UV coordinates for texturing, etc.
+	real u, v; //!< 2D UV coordinates for texturing, etc.
 	
 	Geometry* g; //!< The geometry which was hit
+	
+	// a geometry-specific record of the hit, filled in by findHit() and used by fillSurfaceData():
+	int primitive; //!< which part of the geometry was hit (e.g. the triangle index in a mesh)
+	real lambda2, lambda3; //!< barycentric coordinates of the hit within the primitive (if applicable)
 };
 
 /// An abstract class that represents any intersectable primitive in the scene.
@@ -58,6 +63,46 @@ public:
 	 *         the `data' struct should remain unchanged.
 	 */
 	virtual bool intersect(const Ray& ray, IntersectionData& info) = 0;
+	/**
+	 * @brief The first half of intersect(): only finds the intersection, without computing the shading data.
+	 *
+	 * The semantics are the same as in intersect(), but upon success only data.dist, data.g and the hit
+	 * record (data.primitive, data.lambda2, data.lambda3) are guaranteed to be filled in. When looking for
+	 * the closest intersection among many objects, call findHit() on each, and then fillSurfaceData() just
+	 * once, for the winner. The default implementation calls intersect(), which fills in everything.
+	 */
+	virtual bool findHit(const Ray& ray, IntersectionData& data) { return intersect(ray, data); }
+	/// The second half of intersect(): after a successful findHit() with the same ray, computes the rest of the
+	/// intersection data (the point, normal, UV coordinates, etc.)
+	virtual void fillSurfaceData(const Ray& ray, IntersectionData& data) {}
+	/**
+	 * @brief findHit() for a packet of rays: data[i] is used for packet.rays[i]; only the rays in `mask' are traced.
+	 *
+	 * The packet must be prepared for tracing (see RayPacket::prepareForTracing()).
+	 * @returns the mask of the rays, for which a closer intersection was found.
+	 * The default implementation traces the rays one by one.
+	 */
+	virtual int findHitPacket(const RayPacket& packet, IntersectionData data[], int mask)
+	{
+		int found = 0;
+		for (int i = 0; i < PACKET_SIZE; i++)
+			if ((mask & (1 << i)) && findHit(packet.rays[i], data[i]))
+				found |= 1 << i;
+		return found;
+	}
+	/**
+	 * @brief Checks if the ray hits the geometry anywhere closer than maxDist (an "any hit" query, used for shadow rays).
+	 *
+	 * Unlike intersect(), this doesn't need to find the closest intersection, nor compute any
+	 * shading data (normals, UVs, etc.), so implementations may stop at the first hit they find.
+	 * The default implementation simply calls intersect().
+	 */
+	virtual bool occluded(const Ray& ray, double maxDist)
+	{
+		IntersectionData temp;
+		temp.dist = maxDist;
+		return intersect(ray, temp);
+	}
 	/// Checks if the given point is "inside" the geometry, for whatever definition of
 	/// inside is appropriate for the object. Returns a boolean value accordingly.
 	virtual bool isInside(const Vector& p) const = 0;
@@ -75,6 +120,10 @@ public:
 	virtual bool intersect(const Ray& ray, IntersectionData& data) = 0;
 	virtual bool isInside(const Vector& p) const = 0;
 	
+	/// gets a bounding box around the geometry (in its canonic space).
+	/// Returns false if the geometry is unbounded (e.g., an infinite plane), or its extent is unknown.
+	virtual bool getBBox(BBox& box) const { return false; }
+	
 	// from SceneElement:
 	ElementType getElementType() const { return ELEM_GEOMETRY; }
 };
@@ -91,8 +140,12 @@ public:
 		pb.getDoubleProp("limit", &limit);
 	}
 	bool intersect(const Ray& ray, IntersectionData& data);
+	bool findHit(const Ray& ray, IntersectionData& data);
+	void fillSurfaceData(const Ray& ray, IntersectionData& data);
+	bool occluded(const Ray& ray, double maxDist);
 	const char* getName() { return "Plane"; }
 	bool isInside(const Vector& p) const { return false; }
+	bool getBBox(BBox& box) const;
 };
 
 class Sphere: public Geometry {
@@ -108,14 +161,18 @@ public:
 	}
 
 	bool intersect(const Ray& ray, IntersectionData& data);
+	bool findHit(const Ray& ray, IntersectionData& data);
+	void fillSurfaceData(const Ray& ray, IntersectionData& data);
+	bool occluded(const Ray& ray, double maxDist);
 	const char* getName() { return "Sphere"; }
 	bool isInside(const Vector& p) const { return (center - p).lengthSqr() < R*R; }
+	bool getBBox(BBox& box) const;
 };
 
 class Cube: public Geometry {
 	Vector center;
 	double side;
-	inline bool intersectCubeSide(const Ray& ray, const Vector& center, IntersectionData& data);
+	inline bool intersectCubeSide(const Ray& ray, const Vector& center, IntersectionData& data, int sides);
 public:
 	Cube(const Vector& center = Vector(0, 0, 0), double side = 1): center(center), side(side) {}
 
@@ -126,12 +183,16 @@ public:
 	}
 
 	bool intersect(const Ray& ray, IntersectionData& data);	
+	bool findHit(const Ray& ray, IntersectionData& data);
+	void fillSurfaceData(const Ray& ray, IntersectionData& data);
+	bool occluded(const Ray& ray, double maxDist);
 	const char* getName() { return "Cube"; }
 	bool isInside(const Vector& p) const { 
 		return (fabs(p.x - center.x) <= side * 0.5 &&
 				fabs(p.y - center.y) <= side * 0.5 &&
 				fabs(p.z - center.z) <= side * 0.5);
 	}
+	bool getBBox(BBox& box) const;
 };
 
 class CsgOp: public Geometry {
@@ -150,9 +211,11 @@ public:
 	}
 	
 	bool intersect(const Ray& ray, IntersectionData& data);	
+	// (CSG needs all intersections along the ray anyway, so it uses the default occluded())
 	
 	virtual bool boolOp(bool inLeft, bool inRight) const = 0;
 	bool isInside(const Vector& p) const { return boolOp(left->isInside(p), right->isInside(p)); }
+	bool getBBox(BBox& box) const;
 };
 
 class CsgUnion: public CsgOp {
@@ -198,7 +261,15 @@ public:
 	
 	// from Intersectable:
 	bool intersect(const Ray& ray, IntersectionData& data);
+	bool findHit(const Ray& ray, IntersectionData& data);
+	int findHitPacket(const RayPacket& packet, IntersectionData data[], int mask);
+	void fillSurfaceData(const Ray& ray, IntersectionData& data);
+	bool occluded(const Ray& ray, double maxDist);
 	bool isInside(const Vector& p) const { return geom->isInside(transform.undoPoint(p)); }
+	
+	/// gets the world-space bounding box of the node (i.e., the geometry's box, transformed).
+	/// Returns false if the geometry is unbounded.
+	bool getBBox(BBox& box) const;
 
 	// from SceneElement:
 	ElementType getElementType() const { return ELEM_NODE; }
@@ -56,13 +56,45 @@ Vector Heightfield::getNormal(float x, float y) const
 	return v;
 }
 
-bool Heightfield::intersect(const Ray& _ray, IntersectionData& info)
+bool Heightfield::intersect(const Ray& ray, IntersectionData& info)
+{
+	if (!findHit(ray, info)) return false;
+	fillSurfaceData(ray, info);
+	return true;
+}
+
+bool Heightfield::findHit(const Ray& _ray, IntersectionData& info)
+{
+	RRay ray(_ray);
+	ray.prepareForTracing();
+	double closestDist;
+	if (!march(ray, info.dist, closestDist)) return false;
+	info.dist = closestDist;
+	info.g = this;
+	return true;
+}
+
+void Heightfield::fillSurfaceData(const Ray& ray, IntersectionData& info)
+{
+	info.p = ray.start + ray.dir * info.dist;
+	info.normal = getNormal((float) info.p.x, (float) info.p.z);
+	info.u = info.p.x / W;
+	info.v = info.p.z / H;
+}
+
+bool Heightfield::occluded(const Ray& _ray, double maxDist)
 {
 	RRay ray(_ray);
 	ray.prepareForTracing();
+	double dist;
+	return march(ray, maxDist, dist);
+}
+
+bool Heightfield::march(const RRay& ray, double maxDist, double& closestDist) const
+{
 	double dist = bbox.closestIntersection(ray);
-	if (dist >= info.dist) return false;
-	Vector p = ray.start + ray.dir * (dist + 1e-6); // step firmly inside the bbox
+	if (dist >= maxDist) return false;
+	Vector p = ray.start + ray.dir * (dist + surfaceEpsilon(ray.start + ray.dir * dist)); // step firmly inside the bbox
 	
 	Vector step = ray.dir;
 
@@ -100,12 +132,12 @@ bool Heightfield::intersect(const Ray& _ray, IntersectionData& info)
 		double lz = ray.dir.z > 0 ? (ceil(p.z) - p.z) * mz : (floor(p.z) - p.z) * mz;
 		// advance p along ray.dir until we hit the next X or Z gridline
 		// also, go a little more than that, to assure we're firmly inside the next voxel:
-		Vector p_next = p + step * (min(lx, lz) + 1e-6);
+		Vector p_next = p + step * (min(lx, lz) + surfaceEpsilon(p));
 		// "p" is position before advancement; p_next is after we take a single step.
 		// if any of those are below the height of the nearest four voxels of the heightfield,
 		// we need to test the current voxel for intersection:
 		if (min(p.y, p_next.y) < maxH[z0 * W + x0]) {
-			double closestDist = INF;
+			closestDist = INF;
 			// form ABCD - the four corners of the current voxel, whose heights are taken from the heightmap
 			// then form triangles ABD and BCD and try to intersect the ray with each of them:
 			Vector A = Vector(x0, getHeight(x0, z0), z0);
@@ -117,14 +149,7 @@ bool Heightfield::intersect(const Ray& _ray, IntersectionData& info)
 				// intersection found: ray hits either triangle ABD or BCD. Which one exactly isn't
 				// important, because we calculate the normals by bilinear interpolation of the
 				// precalculated normals at the four corners:
-				if (closestDist > info.dist) return false;
-				info.dist = closestDist;
-				info.p = ray.start + ray.dir * closestDist;
-				info.normal = getNormal((float) info.p.x, (float) info.p.z);
-				info.u = info.p.x / W;
-				info.v = info.p.z / H;
-				info.g = this;
-				return true;
+				return closestDist <= maxDist;
 			}
 		}
 		p = p_next;
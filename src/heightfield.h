@@ -43,12 +43,18 @@ class Heightfield: public Geometry {
 	
 	void buildStruct(void); //!< build the accelerated structure
 	float getHighest(int x, int y, int k) const; //!< Gets the highest nearby peak around position (x, y) on the heightmap with distance no more than 2^k
+	/// finds the first intersection of the ray with the terrain; returns true (and its distance) if it's not further than maxDist
+	bool march(const RRay& ray, double maxDist, double& closestDist) const;
 
 public:
 	Heightfield() { heights = NULL; maxH = NULL; normals = NULL; useOptimization = false; }
 	~Heightfield();
 	bool intersect(const Ray& ray, IntersectionData& info);
+	bool findHit(const Ray& ray, IntersectionData& info);
+	void fillSurfaceData(const Ray& ray, IntersectionData& info);
+	bool occluded(const Ray& ray, double maxDist);
 	bool isInside(const Vector& p ) const { return false; }
+	bool getBBox(BBox& box) const { box = bbox; return true; }
 	void fillProperties(ParsedBlock& pb);
 	const char* getName() { return "Heightfield"; }
 };
@@ -1,5 +1,5 @@
 #include "lights.h"
-#include "random_generator.h"
+#include "sampler.h"
 
 
 int PointLight::getNumSamples()
@@ -13,12 +13,12 @@ void PointLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& sam
 	color = this->color * this->power;
 }
 
-bool PointLight::intersect(const Ray& ray, double& intersectionDist)
+bool PointLight::intersect(const Ray& ray, real& intersectionDist)
 {
 	return false; // you can't intersect a point light
 }
 
-float PointLight::solidAngle(const Vector& x)
+float PointLight::pdf(const Vector& x, const Vector& pointOnLight)
 {
 	return 0;
 }
@@ -27,13 +27,13 @@ float PointLight::solidAngle(const Vector& x)
 
 void RectLight::beginFrame(void)
 {
-	center = transform.point(Vector(0, 0, 0));
 	Vector a = transform.point(Vector(-0.5, 0.0, -0.5));
 	Vector b = transform.point(Vector( 0.5, 0.0, -0.5));
 	Vector c = transform.point(Vector( 0.5, 0.0,  0.5));
 	float width = (float) (b - a).length();
 	float height = (float) (b - c).length();
 	area = width * height; // obtain the area of the light, in world space
+	normal = normalize((b - a) ^ (c - b)); // the canonic light's normal, (0, -1, 0) = X ^ Z
 }
 
 
@@ -44,7 +44,11 @@ int RectLight::getNumSamples()
 
 void RectLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& color)
 {
-	Random& R = getRandomGen();
+	// take the sample point before anything else, so that the dimensions, which the sampler uses, don't
+	// depend on whether the light is visible:
+	Sampler& sampler = getSampler();
+	float u, v;
+	sampler.get2D(u, v);
 	
 	// convert the shade point onto the light's canonic space:
 	Vector shadePosCanonical = transform.undoPoint(shadePos);
@@ -56,8 +60,8 @@ void RectLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& samp
 	}
 	
 	// stratified sampling:
-	float sx = (sampleIdx % xSubd + R.randfloat()) / xSubd;
-	float sy = (sampleIdx / xSubd + R.randfloat()) / ySubd;
+	float sx = (sampleIdx % xSubd + u) / xSubd;
+	float sy = (sampleIdx / xSubd + v) / ySubd;
 	
 	Vector sampleCanonical(sx - 0.5, 0, sy - 0.5);
 	samplePos = transform.point(sampleCanonical);
@@ -67,7 +71,7 @@ void RectLight::getNthSample(int sampleIdx, const Vector& shadePos, Vector& samp
 	color = this->color * (area * this->power * float(dot(Vector(0, -1, 0), shadePos_LS) / shadePos_LS.length()));
 }
 
-bool RectLight::intersect(const Ray& ray, double& intersectionDist)
+bool RectLight::intersect(const Ray& ray, real& intersectionDist)
 {
 	Ray ray_LS = transform.undoRay(ray);
 	// check if ray_LS (the incoming ray, transformed in local space) hits the oriented square 1x1, resting
@@ -88,13 +92,14 @@ bool RectLight::intersect(const Ray& ray, double& intersectionDist)
 	return false;
 }
 
-float RectLight::solidAngle(const Vector& x)
+float RectLight::pdf(const Vector& x, const Vector& pointOnLight)
 {
-	Vector x_canonic = transform.undoPoint(x);
-	if (x_canonic.y >= 0) return 0;
-	Vector x_dir = normalize(x_canonic);
-	float cosA = dot(x_dir, Vector(0, -1, 0));
-	double d = (x - center).lengthSqr();
-	return area * cosA / (1 + d);
+	// the point is chosen uniformly over the light's area, so its pdf is 1/area. Converted to solid angle,
+	// that's distance^2 / (area * cosine at the light):
+	Vector toX = x - pointOnLight;
+	double distSqr = toX.lengthSqr();
+	double cosLight = dot(toX, normal) / sqrt(distSqr);
+	if (cosLight <= 0) return 0;
+	return float(distSqr / (area * cosLight));
 }
 
@@ -68,9 +68,14 @@ public:
 	 *               than the current value of intersectionDist (which is updated upon return)
 	 * @retval false, otherwise.
 	 */
-	virtual bool intersect(const Ray& ray, double& intersectionDist) = 0;
+	virtual bool intersect(const Ray& ray, real& intersectionDist) = 0;
 	
-	virtual float solidAngle(const Vector& x) = 0;
+	/**
+	 * gets the probability density (w.r.t. solid angle, as seen from x) that getNthSample() with a random
+	 * sampleIdx picks the given point on the light. Returns 0 for points that can't be sampled, and
+	 * for lights that can't be hit by rays (the point light).
+	 */
+	virtual float pdf(const Vector& x, const Vector& pointOnLight) = 0;
 };
 
 /// The good ol' point light
@@ -79,8 +84,8 @@ class PointLight: public Light {
 public:
 	int getNumSamples();
 	void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& color);
-	bool intersect(const Ray& ray, double& intersectionDist);
-	float solidAngle(const Vector& x);
+	bool intersect(const Ray& ray, real& intersectionDist);
+	float pdf(const Vector& x, const Vector& pointOnLight);
 
 	void fillProperties(ParsedBlock& pb)
 	{
@@ -97,14 +102,14 @@ class RectLight: public Light {
 	Transform transform;
 	int xSubd, ySubd;
 	float area;
-	Vector center;
+	Vector normal; //!< the direction in which the light shines, in world space
 public:
 	RectLight(): Light() { xSubd = 2; ySubd = 2; transform.reset(); }
 	void beginFrame(void);
 	int getNumSamples();
 	void getNthSample(int sampleIdx, const Vector& shadePos, Vector& samplePos, Color& color);
-	bool intersect(const Ray& ray, double& intersectionDist);
-	float solidAngle(const Vector& x);
+	bool intersect(const Ray& ray, real& intersectionDist);
+	float pdf(const Vector& x, const Vector& pointOnLight);
 	
 	void fillProperties(ParsedBlock& pb)
 	{
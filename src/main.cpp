@@ -20,6 +20,8 @@
 
 #include <SDL/SDL.h>
 #include <vector>
+#include <atomic>
+#include <limits.h>
 #include <iostream>
 #include "sdl.h"
 #include "matrix.h"
@@ -29,32 +31,62 @@
 #include "environment.h"
 #include "mesh.h"
 #include "random_generator.h"
+#include "sampler.h"
 #include "scene.h"
 #include "lights.h"
 #include "cxxptl_sdl.h"
+#include "bvh.h"
+#include "buckets.h"
+#include "distributed.h"
 using namespace std;
 
-Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; //!< virtual framebuffer
+FrameBuffer vfb; //!< virtual framebuffer
+const char* defaultScene = "data/boxed.trinity";
+const char* headlessOutput = NULL; //!< if set, render without a window and save the result there (--headless)
+int numWorkers = 0; //!< if nonzero, render through that many worker processes (--workers, see distributed.h)
+int workerThreads = 0; //!< threads per worker process
+bool workerMode = false; //!< this process is a worker, started by a coordinator (--worker)
+
 bool testVisibility(const Vector& from, const Vector& to);
 
-/// traces a ray in the scene and returns the visible light that comes from that direction
-Color raytrace(const Ray& ray)
+/// finds the closest intersection of a ray with the scene's nodes (using the BVH, if it is built).
+/// Returns the node that was hit, or NULL.
+static Node* findClosestNode(const Ray& ray, IntersectionData& data)
 {
-	IntersectionData data;
 	Node* closestNode = NULL;
-	
-	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
-
-	if (ray.flags & RF_DEBUG)
-		cout << "  Raytrace[start = " << ray.start << ", dir = " << ray.dir << "]\n";
+	if (scene.bvh) {
+		closestNode = scene.bvh->intersect(ray, data);
+	} else {
+		for (int i = 0; i < (int) scene.nodes.size(); i++)
+			if (scene.nodes[i]->findHit(ray, data))
+				closestNode = scene.nodes[i];
+	}
+	// only the closest intersection needs its normal, UVs, etc.:
+	if (closestNode) closestNode->fillSurfaceData(ray, data);
+	return closestNode;
+}
 
-	data.dist = 1e99;
-	
-	// find closest intersection point:
-	for (int i = 0; i < (int) scene.nodes.size(); i++)
-		if (scene.nodes[i]->intersect(ray, data))
-			closestNode = scene.nodes[i];
+/// the same as findClosestNode(), but for a packet of rays. closestNode[i] is set to the node hit by
+/// the i-th ray (or NULL)
+static void findClosestNodes(const RayPacket& packet, IntersectionData data[], Node* closestNode[])
+{
+	for (int i = 0; i < PACKET_SIZE; i++) closestNode[i] = NULL;
+	if (scene.bvh) {
+		scene.bvh->intersectPacket(packet, data, closestNode);
+	} else {
+		for (int i = 0; i < (int) scene.nodes.size(); i++) {
+			int found = scene.nodes[i]->findHitPacket(packet, data, packet.mask);
+			for (int j = 0; j < PACKET_SIZE; j++)
+				if (found & (1 << j)) closestNode[j] = scene.nodes[i];
+		}
+	}
+	for (int i = 0; i < PACKET_SIZE; i++)
+		if (closestNode[i]) closestNode[i]->fillSurfaceData(packet.rays[i], data[i]);
+}
 
+/// computes the light, that comes along the ray, given its closest intersection (as found by findClosestNode())
+static Color shadeHit(const Ray& ray, Node* closestNode, IntersectionData& data)
+{
 	// check if the closest intersection point is actually a light:
 	bool hitLight = false;
 	Color hitLightColor;
@@ -87,41 +119,80 @@ Color raytrace(const Ray& ray)
 	return closestNode->shader->shade(ray, data);
 }
 
-Color pathtrace(const Ray& ray, const Color& pathMultiplier, Random& rgen)
+/// traces a ray in the scene and returns the visible light that comes from that direction
+Color raytrace(const Ray& ray)
 {
 	IntersectionData data;
-	Node* closestNode = NULL;
 	
 	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
 
+	if (ray.flags & RF_DEBUG)
+		cout << "  Raytrace[start = " << ray.start << ", dir = " << ray.dir << "]\n";
+
 	data.dist = 1e99;
 	
 	// find closest intersection point:
-	for (int i = 0; i < (int) scene.nodes.size(); i++)
-		if (scene.nodes[i]->intersect(ray, data))
-			closestNode = scene.nodes[i];
+	Node* closestNode = findClosestNode(ray, data);
+	return shadeHit(ray, closestNode, data);
+}
+
+/// the same as raytrace(), but for a packet of rays: the closest intersections are found for all
+/// rays at once, and then each ray is shaded on its own (any secondary rays are traced one by one).
+void raytracePacket(const RayPacket& packet, Color result[])
+{
+	IntersectionData data[PACKET_SIZE];
+	Node* closestNode[PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; i++) data[i].dist = 1e99;
+	findClosestNodes(packet, data, closestNode);
+	for (int i = 0; i < PACKET_SIZE; i++)
+		if (packet.mask & (1 << i))
+			result[i] = shadeHit(packet.rays[i], closestNode[i], data[i]);
+}
+
+// the power heuristic for multiple importance sampling: the weight of a sample, taken by a strategy with pdf
+// `pdfA', given that another strategy could have taken the same sample with pdf `pdfB'
+static inline float misWeight(float pdfA, float pdfB)
+{
+	pdfA *= pdfA;
+	pdfB *= pdfB;
+	return pdfA / (pdfA + pdfB);
+}
+
+/// continues a path with the given ray. rayPdf is the pdf, with which the last BRDF along the path chose the
+/// ray (only used if ray.flags has RF_DIFFUSE)
+Color pathtrace(const Ray& ray, const Color& pathMultiplier, Sampler& sampler, float rayPdf = 0)
+{
+	IntersectionData data;
+	
+	if (ray.depth > scene.settings.maxTraceDepth) return Color(0, 0, 0);
+	sampler.beginBounce(ray.depth);
+
+	data.dist = 1e99;
+	
+	// find closest intersection point:
+	Node* closestNode = findClosestNode(ray, data);
 
 	// check if the closest intersection point is actually a light:
-	bool hitLight = false;
-	Color hitLightColor;
+	Light* hitLight = NULL;
 	for (int i = 0; i < (int) scene.lights.size(); i++) {
-		if (scene.lights[i]->intersect(ray, data.dist)) {
-			hitLight = true;
-			hitLightColor = scene.lights[i]->getColor();
-		}
+		if (scene.lights[i]->intersect(ray, data.dist))
+			hitLight = scene.lights[i];
 	}
 	if (hitLight) {
 		/*
-		 * if the ray actually hit a light, check if we need to pass this light back along the path.
-		 * If the last surface along the path was a diffuse one (Lambert/Phong), we need to discard the
-		 * light contribution, since for diffuse material we do explicit light sampling too, thus the
-		 * light would be over-represented and the image a bit too bright. We may discard light checks
-		 * for secondary rays altogether, but we would lose caustics and light reflections that way.
+		 * if the ray actually hit a light, pass this light back along the path. If the last surface
+		 * along the path was a diffuse or glossy one (Lambert/Phong), the explicit light sampling there
+		 * (see below) could have found the same point on the light too. Both estimates are kept, but
+		 * weighted by multiple importance sampling, so that each dominates where its pdf is higher: the
+		 * light sampling for small lights and rough surfaces, the BRDF sampling for large lights and
+		 * shiny surfaces. After a mirror or a refraction, this is the only way to reach the light.
 		 */
-		if (ray.flags & RF_DIFFUSE)
-			return Color(0, 0, 0);
-		else
-			return hitLightColor * pathMultiplier;
+		Color result = hitLight->getColor() * pathMultiplier;
+		if (ray.flags & RF_DIFFUSE) {
+			float lightPdf = hitLight->pdf(ray.start, ray.start + ray.dir * data.dist) / scene.lights.size();
+			result = result * misWeight(rayPdf, lightPdf);
+		}
+		return result;
 	}
 	// no intersection? use the environment, if present:
 	if (!closestNode) {
@@ -137,43 +208,47 @@ Color pathtrace(const Ray& ray, const Color& pathMultiplier, Random& rgen)
 	//    This approximates the direct lighting towards the intersection point.
 	if (!scene.lights.empty()) {
 		// choose a random light:
-		int lightIndex = rgen.randint(0, scene.lights.size() - 1);
+		int numLights = (int) scene.lights.size();
+		sampler.setBounceDimension(SAMPLER_LIGHT_CHOICE);
+		int lightIndex = min(int(sampler.get1D() * numLights), numLights - 1);
 		Light* light = scene.lights[lightIndex];
 		int numLightSamples = light->getNumSamples();
 
 		// choose a random sample of that light:
-		int lightSampleIdx = rgen.randint(0, numLightSamples - 1);
+		int lightSampleIdx = min(int(sampler.get1D() * numLightSamples), numLightSamples - 1);
 
 		// sample the light and see if it came out nonzero:
 		Vector pointOnLight;
 		Color lightColor;
+		sampler.setBounceDimension(SAMPLER_LIGHT_POS);
 		light->getNthSample(lightSampleIdx, data.p, pointOnLight, lightColor);
-		if (lightColor.intensity() > 0 && testVisibility(data.p + data.normal * 1e-6, pointOnLight)) {
+		if (lightColor.intensity() > 0 && testVisibility(data.p + data.normal * surfaceEpsilon(data.p), pointOnLight)) {
 			// w_out - the outgoing ray in the BRDF evaluation
 			Ray w_out;
-			w_out.start = data.p + data.normal * 1e-6;
+			w_out.start = data.p + data.normal * surfaceEpsilon(data.p);
 			w_out.dir = pointOnLight - w_out.start;
 			w_out.dir.normalize();
 			//
-			// calculate the light contribution in a manner, consistent with classic path tracing:
-			float solidAngle = light->solidAngle(w_out.start); // solid angle of the light, as seen from x.
 			// evaluate the BRDF:
 			Color brdfAtPoint = closestNode->shader->eval(data, ray, w_out); 
 			
-			lightColor = light->getColor() * solidAngle / (2*PI);
-			
-			// the probability to choose a particular light among all lights: 1/N
-			float pdfChooseLight = 1.0f / (float) scene.lights.size();
-			// the probability to shoot a ray in a random direction: 1/2*pi
-			float pdfInLight = 1 / (2*PI);
-			
-			// combined probability for that ray:
-			float pdf = pdfChooseLight * pdfInLight;
-			
-			if (brdfAtPoint.intensity() > 0)
+			if (brdfAtPoint.intensity() > 0) {
+				// the probability to choose a particular light among all lights: 1/N
+				float pdfChooseLight = 1.0f / (float) numLights;
+				// the light's sample color, divided by the squared distance, is the incoming light, already
+				// divided by the probability of choosing that point on the light (see Lambert::shade()):
+				Color lightOverPdf = lightColor / (float) (pointOnLight - data.p).lengthSqr();
+				// the multiple importance sampling weight, complementary to the BRDF sampling's, above.
+				// Point lights can't be hit by the BRDF sampling, so their weight is 1:
+				float lightPdf = light->pdf(w_out.start, pointOnLight) * pdfChooseLight;
+				float weight = 1;
+				if (lightPdf > 0)
+					weight = misWeight(lightPdf, closestNode->shader->pdf(data, ray, w_out));
+				
 				// Kajia's rendering equation, evaluated at a single incoming/outgoing directions pair:
-				                /* Li */    /*BRDFs@path*/    /*BRDF*/   /*ray probability*/
-				resultDirect = lightColor * pathMultiplier * brdfAtPoint / pdf; 
+				          /*  Li / pdf  */    /*BRDFs@path*/    /*BRDF*/         /*MIS, light choice*/
+				resultDirect = lightOverPdf * pathMultiplier * brdfAtPoint * (weight / pdfChooseLight);
+			}
 		}
 	}
 
@@ -183,12 +258,13 @@ Color pathtrace(const Ray& ray, const Color& pathMultiplier, Random& rgen)
 	Color brdfEval; // brdf at the chosen direction
 	float pdf; // the probability to choose that specific newRay
 	// sample the BRDF:
+	sampler.setBounceDimension(SAMPLER_BRDF);
 	closestNode->shader->spawnRay(data, ray, w_out, brdfEval, pdf);
 	
 	if (pdf < 0) return Color(1, 0, 0);  // bogus BRDF; mark in red
-	if (pdf == 0) return Color(0, 0, 0);  // terminate the path, as required
+	if (pdf == 0) return resultDirect;  // terminate the path, as required
 	Color resultGi;
-	resultGi = pathtrace(w_out, pathMultiplier * brdfEval / pdf, rgen); // continue the path normally; accumulate the new term to the BRDF product
+	resultGi = pathtrace(w_out, pathMultiplier * brdfEval / pdf, sampler, pdf); // continue the path normally; accumulate the new term to the BRDF product
 	
 	return resultDirect + resultGi;
 }
@@ -204,24 +280,25 @@ bool testVisibility(const Vector& from, const Vector& to)
 	ray.dir.normalize();
 	ray.flags |= RF_SHADOW;
 	
-	IntersectionData temp;
-	temp.dist = (to - from).length();
+	double maxDist = (to - from).length();
 	
 	// if there's any obstacle between from and to, the points aren't visible.
 	// we can stop at the first such object, since we don't care about the distance.
+	if (scene.bvh) return !scene.bvh->occluded(ray, maxDist);
 	for (int i = 0; i < (int) scene.nodes.size(); i++)
-		if (scene.nodes[i]->intersect(ray, temp))
+		if (scene.nodes[i]->occluded(ray, maxDist))
 			return false;
 	
 	return true;
 }
 
-bool needsAA[VFB_MAX_SIZE][VFB_MAX_SIZE];
+Array2D<bool> needsAA;
+Array2D<int> sampleCount; //!< how many rays/paths were shot through each pixel in the first pass
 
 /// checks if two colors are "too different":
 inline bool tooDifferent(const Color& a, const Color& b)
 {
-	const float THRESHOLD = 0.1; // max color threshold; if met on any of the three channels, consider the colors too different
+	const float THRESHOLD = scene.settings.aaThresh; // max color threshold; if met on any of the three channels, consider the colors too different
 	for (int comp = 0; comp < 3; comp++) {
 		float theMax = max(a[comp], b[comp]);
 		float theMin = min(a[comp], b[comp]);
@@ -234,6 +311,40 @@ inline bool tooDifferent(const Color& a, const Color& b)
 	return false;
 }
 
+/// finds the pixels in `r' that need anti-aliasing (marks them in needsAA), by comparing each one with
+/// its neighbours. The neighbours must already be rendered, even those just outside of `r'.
+static void findAAPixels(const Rect& r)
+{
+	int W = frameWidth();
+	int H = frameHeight();
+	for (int y = r.y0; y < r.y1; y++) {
+		for (int x = r.x0; x < r.x1; x++) {
+			Color neighs[5];
+			neighs[0] = vfb[y][x];
+			
+			neighs[1] = vfb[y][x     > 0 ? x - 1 : x];
+			neighs[2] = vfb[y][x + 1 < W ? x + 1 : x];
+
+			neighs[3] = vfb[y     > 0 ? y - 1 : y][x];
+			neighs[4] = vfb[y + 1 < H ? y + 1 : y][x];
+			
+			Color average(0, 0, 0);
+			
+			for (int i = 0; i < 5; i++)
+				average += neighs[i];
+			average /= 5.0f;
+			
+			needsAA[y][x] = false;
+			for (int i = 0; i < 5; i++) {
+				if (tooDifferent(neighs[i], average)) {
+					needsAA[y][x] = true;
+					break;
+				}
+			}
+		}
+	}
+}
+
 // combine the results from the "left" and "right" camera for a single pixel.
 // the implementation here creates an anaglyph image: it desaturates the input
 // colors, masks them (left=red, right=cyan) and then merges them.
@@ -244,35 +355,81 @@ static inline Color combineStereo(Color left, Color right)
 	return left * Color(1, 0, 0) + right * Color(0, 1, 1);
 }
 
-// trace a ray through pixel coords (x, y).
-Color renderSample(double x, double y, int dx = 1, int dy = 1)
+// the pixel coordinates, as keys for Sampler::beginSample(); they're fixed point, so that the AA subsamples differ
+static inline unsigned sampleKey(double coord)
+{
+	return (unsigned) (int) floor(coord * 256);
+}
+
+// takes the given random sample (a DOF ray, or a GI path) through the pixel block (x, y) - (x + dx, y + dy)
+static Color randomSample(double x, double y, int dx, int dy, int sample, Sampler& sampler)
 {
+	sampler.beginSample(sampleKey(x), sampleKey(y), sample);
+	float u, v;
+	sampler.get2D(u, v); // the position within the pixel (both eyes use the same one in stereo mode)
+	double sx = x + u * dx, sy = y + v * dy;
 	if (scene.camera->dof) {
-		Color average(0, 0, 0);
-		Random& R = getRandomGen();
-		for (int i = 0; i < scene.camera->numSamples; i++) {
-			if (scene.camera->stereoSeparation == 0) // stereoscopic rendering?
-				average += raytrace(scene.camera->getScreenRay(x + R.randdouble() * dx, y + R.randdouble() * dy));
-			else {
-				average += combineStereo(
-					raytrace(scene.camera->getScreenRay(x + R.randdouble() * dx, y + R.randdouble() * dy, CAMERA_LEFT)),
-					raytrace(scene.camera->getScreenRay(x + R.randdouble() * dx, y + R.randdouble() * dy, CAMERA_RIGHT))
-				);
-			}
-		}
-		return average / scene.camera->numSamples;
-	} else if (scene.settings.gi) {
-		Color average(0, 0, 0);
-		Random& R = getRandomGen();
-		for (int i = 0; i < scene.settings.numPaths; i++) {
-			average += pathtrace(
-				scene.camera->getScreenRay(x + R.randdouble() * dx, y + R.randdouble() * dy),
-				Color(1, 1, 1),
-				R
+		if (scene.camera->stereoSeparation == 0) // stereoscopic rendering?
+			return raytrace(scene.camera->getScreenRay(sx, sy));
+		else
+			return combineStereo(
+				raytrace(scene.camera->getScreenRay(sx, sy, CAMERA_LEFT)),
+				raytrace(scene.camera->getScreenRay(sx, sy, CAMERA_RIGHT))
 			);
+	}
+	return pathtrace(scene.camera->getScreenRay(sx, sy), Color(1, 1, 1), sampler);
+}
+
+/// takes random samples through the pixel block (x, y) - (x + dx, y + dy), until the 95% confidence interval
+/// of the pixel's intensity is within adaptiveThresh of its mean (but at least adaptiveMinSamples, and at most
+/// maxSamples). Returns the average; the number of samples taken is stored in `samplesTaken'.
+static Color adaptiveSample(double x, double y, int dx, int dy, int maxSamples, int& samplesTaken)
+{
+	Sampler& sampler = getSampler();
+	int minSamples = min(scene.settings.adaptiveMinSamples, maxSamples);
+	Color sum(0, 0, 0);
+	double sumI = 0, sumI2 = 0; // running sums of the intensity and its square, for the mean and variance
+	int n = 0;
+	while (n < maxSamples) {
+		Color c = randomSample(x, y, dx, dy, n, sampler);
+		float I = c.intensity();
+		sum += c;
+		sumI += I;
+		sumI2 += I * I;
+		n++;
+		if (n < minSamples) continue;
+		double mean = sumI / n;
+		double variance = max(0.0, (sumI2 - n * mean * mean) / (n - 1));
+		double halfWidth = 1.96 * sqrt(variance / n);
+		// in dark pixels, require the same absolute precision as at intensity 0.1; they need no more than that
+		if (halfWidth <= scene.settings.adaptiveThresh * max(mean, 0.1)) break;
+	}
+	samplesTaken = n;
+	return sum / n;
+}
+
+// trace a ray through pixel coords (x, y). If `samplesTaken' is given, the number of rays (or paths)
+// used is stored there.
+Color renderSample(double x, double y, int dx = 1, int dy = 1, int* samplesTaken = NULL)
+{
+	if (scene.camera->dof || scene.settings.gi) {
+		int maxSamples = scene.camera->dof ? scene.camera->numSamples : scene.settings.numPaths;
+		int n = maxSamples;
+		Color result;
+		if (scene.settings.adaptiveSampling) {
+			result = adaptiveSample(x, y, dx, dy, maxSamples, n);
+		} else {
+			Sampler& sampler = getSampler();
+			Color sum(0, 0, 0);
+			for (int i = 0; i < maxSamples; i++)
+				sum += randomSample(x, y, dx, dy, i, sampler);
+			result = sum / maxSamples;
 		}
-		return average / scene.settings.numPaths;
+		if (samplesTaken) *samplesTaken = n;
+		return result;
 	} else {
+		if (samplesTaken) *samplesTaken = 1;
+		getSampler().beginSample(sampleKey(x), sampleKey(y), 0); // for the area lights' samples
 		if (scene.camera->stereoSeparation == 0)
 			return raytrace(scene.camera->getScreenRay(x, y));
 		else
@@ -287,10 +444,32 @@ Color renderSample(double x, double y, int dx = 1, int dy = 1)
 // gets the color for a single pixel, without antialiasing
 Color renderPixelNoAA(int x, int y, int dx = 1, int dy = 1)
 {
-	vfb[y][x] = renderSample(x, y, dx, dy);
+	vfb[y][x] = renderSample(x, y, dx, dy, &sampleCount[y][x]);
 	return vfb[y][x];
 }
 
+// can the primary rays be traced in packets? Only if there's a single, plain ray per pixel
+static bool canUsePackets(void)
+{
+	return scene.settings.usePackets && !scene.camera->dof && !scene.settings.gi && scene.camera->stereoSeparation == 0;
+}
+
+// renders all pixels of a rectangle, without antialiasing, using ray packets
+void renderRectPacketsNoAA(const Rect& r)
+{
+	RayPacket packet;
+	Color colors[PACKET_SIZE];
+	for (int y = r.y0; y < r.y1; y += PACKET_WIDTH)
+		for (int x = r.x0; x < r.x1; x += PACKET_WIDTH) {
+			getSampler().beginSample(sampleKey(x), sampleKey(y), 0);
+			scene.camera->getScreenRayPacket(x, y, r.x1, r.y1, packet);
+			raytracePacket(packet, colors);
+			for (int i = 0; i < PACKET_SIZE; i++)
+				if (packet.mask & (1 << i))
+					vfb[y + i / PACKET_WIDTH][x + i % PACKET_WIDTH] = colors[i];
+		}
+}
+
 // gets the color for a single pixel, with antialiasing. Assumes the pixel
 // already holds some value.
 // This simply adds four more AA samples and averages the result.
@@ -311,115 +490,260 @@ Color renderPixelAA(int x, int y)
 	return vfb[y][x];
 }
 
-class TaskNoAA: public Parallel
+CostMap costMap; //!< per-region render time estimates, from the prepass or from the last frame
+ThreadPool threadPool;
+FrameBuffer pathSum; //!< progressive rendering: the sum of all paths through each pixel so far...
+Array2D<int> pathCount; //!< ... and their count
+
+class TaskPrepass: public ParallelFor {
+	const vector<Rect>& buckets;
+public:
+	vector<vector<Rect> > blocks;    //!< the 16x16 blocks of each bucket...
+	vector<vector<double> > times;   //!< ... and how long each of them took (seconds)
+	std::atomic<bool> interrupted;   //!< set by any of the threads, so it's atomic
+	
+	TaskPrepass(const vector<Rect>& buckets):
+		buckets(buckets), blocks(buckets.size()), times(buckets.size()), interrupted(false)
+	{
+	}
+	
+	bool process(int index, int threadIndex)
+	{
+		// trace a single ray for each 16x16 block of the bucket:
+		const Rect& r = buckets[index];
+		for (int dy = 0; dy < r.h; dy += 16) {
+			int ey = min(r.h, dy + 16);
+			for (int dx = 0; dx < r.w; dx += 16) {
+				int ex = min(r.w, dx + 16);
+				Rect block(r.x0 + dx, r.y0 + dy, r.x0 + ex, r.y0 + ey);
+				double startTime = getPreciseTime();
+				Color c = renderPixelNoAA(block.x0, block.y0, block.w, block.h);
+				blocks[index].push_back(block);
+				times[index].push_back(getPreciseTime() - startTime);
+				if (!drawRect(block, c)) {
+					interrupted = true;
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+};
+
+class TaskNoAA: public ParallelFor
 {
 	const vector<Rect>& buckets;
-	InterlockedInt counter;
 public:
-	TaskNoAA(const vector<Rect>& buckets): buckets(buckets), counter(0)
+	vector<double> times; //!< how long did each bucket take (seconds)
+	
+	TaskNoAA(const vector<Rect>& buckets): buckets(buckets), times(buckets.size(), 0.0)
 	{
 	}
 	
-	void entry(int thread_index, int thread_count)
+	bool process(int index, int threadIndex)
 	{
 		// first pass: shoot just one ray per pixel
-		int i;
-		while ((i = counter++) < (int) buckets.size()) {
-			const Rect& r = buckets[i];
+		const Rect& r = buckets[index];
+		double startTime = getPreciseTime();
+		if (canUsePackets())
+			renderRectPacketsNoAA(r);
+		else
 			for (int y = r.y0; y < r.y1; y++)
 				for (int x = r.x0; x < r.x1; x++)
 					renderPixelNoAA(x, y);
-			if (!scene.settings.interactive)
-				if (!displayVFBRect(r, vfb))
-					return;
-		}
-		
+		times[index] = getPreciseTime() - startTime;
+		if (!scene.settings.interactive)
+			if (!displayVFBRect(r, vfb))
+				return false;
+		return true;
 	}
 };
 
-class TaskAA: public Parallel {
+class TaskFindAA: public ParallelFor {
 	const vector<Rect>& buckets;
-	InterlockedInt counter;
 public:
-	TaskAA(const vector<Rect>& buckets): buckets(buckets), counter(0)
+	TaskFindAA(const vector<Rect>& buckets): buckets(buckets)
 	{
 	}
 
-	void entry(int threadIndex, int threadCount ) {
-		int i;
-		while ((i = counter++) < (int) buckets.size()) {
-			const Rect& r = buckets[i];
-			if (!markRegion(r))
-				return;
-			for (int y = r.y0; y < r.y1; y++)
-				for (int x = r.x0; x < r.x1; x++)
-					if (needsAA[y][x]) renderPixelAA(x, y);
-			if (!displayVFBRect(r, vfb))
-				return;
+	bool process(int index, int threadIndex)
+	{
+		findAAPixels(buckets[index]);
+		return true;
+	}
+};
+
+class TaskAA: public ParallelFor {
+	const vector<Rect>& buckets;
+public:
+	TaskAA(const vector<Rect>& buckets): buckets(buckets)
+	{
+	}
+
+	bool process(int index, int threadIndex)
+	{
+		const Rect& r = buckets[index];
+		if (!markRegion(r))
+			return false;
+		for (int y = r.y0; y < r.y1; y++)
+			for (int x = r.x0; x < r.x1; x++)
+				if (needsAA[y][x]) renderPixelAA(x, y);
+		return displayVFBRect(r, vfb);
+	}
+};
+
+
+/// a single pass of the progressive rendering: adds `paths' more paths to each pixel
+class TaskProgressive: public ParallelFor {
+	const vector<Rect>& buckets;
+	int paths;
+	double deadline;
+public:
+	vector<double> times; //!< how long did each bucket take (seconds)
+	std::atomic<bool> interrupted, timeIsUp; //!< set by any of the threads, so they're atomic
+	
+	TaskProgressive(const vector<Rect>& buckets, int paths, double deadline):
+		buckets(buckets), paths(paths), deadline(deadline), times(buckets.size(), 0.0),
+		interrupted(false), timeIsUp(false)
+	{
+	}
+	
+	bool process(int index, int threadIndex)
+	{
+		const Rect& r = buckets[index];
+		double startTime = getPreciseTime();
+		if (startTime >= deadline) {
+			timeIsUp = true;
+			return false;
 		}
+		Sampler& sampler = getSampler();
+		for (int y = r.y0; y < r.y1; y++)
+			for (int x = r.x0; x < r.x1; x++) {
+				for (int i = 0; i < paths; i++)
+					pathSum[y][x] += randomSample(x, y, 1, 1, pathCount[y][x] + i, sampler);
+				pathCount[y][x] += paths;
+				vfb[y][x] = pathSum[y][x] / pathCount[y][x];
+			}
+		times[index] = getPreciseTime() - startTime;
+		if (!displayVFBRect(r, vfb)) {
+			interrupted = true;
+			return false;
+		}
+		return true;
 	}
 };
 
+/// prints how many paths per pixel the progressive rendering has achieved
+static void printPathStats(void)
+{
+	int minPaths = INT_MAX, maxPaths = 0;
+	double total = 0;
+	for (int y = 0; y < pathCount.getHeight(); y++)
+		for (int x = 0; x < pathCount.getWidth(); x++) {
+			minPaths = min(minPaths, pathCount[y][x]);
+			maxPaths = max(maxPaths, pathCount[y][x]);
+			total += pathCount[y][x];
+		}
+	printf("Paths per pixel: %.2f average (min %d, max %d)\n",
+	       total / (pathCount.getWidth() * pathCount.getHeight()), minPaths, maxPaths);
+}
+
+/// renders the frame with path tracing in several passes, each adding pathsPerPass paths to every pixel,
+/// until numPaths are reached (or, if timeLimit is set, until the time is up). The running average is
+/// displayed after each pass.
+static void renderProgressive(void)
+{
+	int W = frameWidth();
+	int H = frameHeight();
+	bool timed = scene.settings.timeLimit > 0;
+	double deadline = timed ? getPreciseTime() + scene.settings.timeLimit : INF;
+	pathSum.resize(W, H);
+	pathSum.clear(Color(0, 0, 0));
+	pathCount.resize(W, H);
+	pathCount.clear(0);
+	
+	std::vector<Rect> buckets = getBucketsList(scene.settings.bucketSize);
+	for (int pathsDone = 0; timed || pathsDone < scene.settings.numPaths; ) {
+		int paths = scene.settings.pathsPerPass;
+		if (!timed) paths = min(paths, scene.settings.numPaths - pathsDone);
+		// the first pass always completes, even past the time limit; otherwise, the buckets that didn't
+		// make it would be left with no paths at all (and the previous frame's pixels):
+		TaskProgressive task(buckets, paths, pathsDone ? deadline : INF);
+		threadPool.parallel_for(buckets.size(), &task, scene.settings.numThreads);
+		if (task.interrupted) return;
+		if (task.timeIsUp) break;
+		if (!pathsDone && getPreciseTime() > deadline)
+			printf("Warning: the time limit (%.2fs) is too short even for a single pass\n", scene.settings.timeLimit);
+		pathsDone += paths;
+		
+		// each pass costs about the same, so the timings of this one schedule the next:
+		costMap.reset(W, H);
+		for (int i = 0; i < (int) buckets.size(); i++)
+			costMap.record(buckets[i], task.times[i]);
+		if (scene.settings.adaptiveBuckets) {
+			buckets = getBucketsList(scene.settings.bucketSize);
+			scheduleBuckets(buckets, costMap, scene.settings.numThreads);
+		}
+	}
+	printPathStats();
+}
 
 void renderScene(void)
 {
 	int W = frameWidth();
 	int H = frameHeight();
 	
-	std::vector<Rect> buckets = getBucketsList();
+	if (numWorkers > 0) {
+		renderDistributed(defaultScene, numWorkers, workerThreads);
+		return;
+	}
+	if (scene.settings.gi && (scene.settings.progressive || scene.settings.timeLimit > 0)) {
+		renderProgressive();
+		return;
+	}
+	
+	std::vector<Rect> buckets = getBucketsList(scene.settings.bucketSize);
 	if (scene.settings.wantPrepass || scene.settings.gi) {
 		// We render the whole screen in three passes.
 		// 1) First pass - use very coarse resolution rendering, tracing a single ray for a 16x16 block:
-		for (size_t i = 0; i < buckets.size(); i++) {
-			Rect& r = buckets[i];
-			for (int dy = 0; dy < r.h; dy += 16) {
-				int ey = min(r.h, dy + 16);
-				for (int dx = 0; dx < r.w; dx += 16) {
-					int ex = min(r.w, dx + 16);
-					Color c = renderPixelNoAA(r.x0 + dx, r.y0 + dy, ex - dx, ey - dy);
-					if (!drawRect(Rect(r.x0 + dx, r.y0 + dy, r.x0 + ex, r.y0 + ey), c))
-						return;
-				}
-			}
-		}
+		// (the time for each ray is also a good estimate of the cost of its block)
+		TaskPrepass task0(buckets);
+		threadPool.parallel_for(buckets.size(), &task0, scene.settings.numThreads);
+		if (task0.interrupted) return;
+		costMap.reset(W, H);
+		for (int i = 0; i < (int) buckets.size(); i++)
+			for (int j = 0; j < (int) task0.blocks[i].size(); j++)
+				costMap.record(task0.blocks[i][j], task0.times[i][j]);
 	}
+	
+	// if there's no prepass, the estimates from the previous frame are used (if any):
+	if (scene.settings.adaptiveBuckets)
+		scheduleBuckets(buckets, costMap, scene.settings.numThreads);
 
-	static ThreadPool pool;
 	TaskNoAA task1(buckets);
-	pool.run(&task1, scene.settings.numThreads);
+	threadPool.parallel_for(buckets.size(), &task1, scene.settings.numThreads);
+	
+	costMap.reset(W, H);
+	for (int i = 0; i < (int) buckets.size(); i++)
+		costMap.record(buckets[i], task1.times[i]);
 
 	if (scene.settings.wantAA && !scene.camera->dof && !scene.settings.gi) {
 		// second pass: find pixels, that need anti-aliasing, by analyzing their neighbours
-		for (int y = 0; y < H; y++) {
-			for (int x = 0; x < W; x++) {
-				Color neighs[5];
-				neighs[0] = vfb[y][x];
-				
-				neighs[1] = vfb[y][x     > 0 ? x - 1 : x];
-				neighs[2] = vfb[y][x + 1 < W ? x + 1 : x];
-
-				neighs[3] = vfb[y     > 0 ? y - 1 : y][x];
-				neighs[4] = vfb[y + 1 < H ? y + 1 : y][x];
-				
-				Color average(0, 0, 0);
-				
-				for (int i = 0; i < 5; i++)
-					average += neighs[i];
-				average /= 5.0f;
-				
-				for (int i = 0; i < 5; i++) {
-					if (tooDifferent(neighs[i], average)) {
-						needsAA[y][x] = true;
-						break;
-					}
-				}
-			}
-		}
+		TaskFindAA taskFind(buckets);
+		threadPool.parallel_for(buckets.size(), &taskFind, scene.settings.numThreads);
 	}
 
 	bool previewAA = false; // change to true to make it just display which pixels are selected for anti-aliasing
+	bool previewSamples = false; // change to true to display the sample counts of adaptive sampling (black: few, white: max)
 	
-	if (previewAA) {
+	if (previewSamples) {
+		int maxSamples = scene.camera->dof ? scene.camera->numSamples : scene.settings.numPaths;
+		for (int y = 0; y < H; y++)
+			for (int x = 0; x < W; x++) {
+				float f = sampleCount[y][x] / (float) maxSamples;
+				vfb[y][x] = Color(f, f, f);
+			}
+	} else if (previewAA) {
 		for (int y = 0; y < H; y++)
 			for (int x = 0; x < W; x++)
 				if (needsAA[y][x])
@@ -434,12 +758,53 @@ void renderScene(void)
 		 * after that.
 		 */
 		if (scene.settings.wantAA && !scene.camera->dof) {
+			if (scene.settings.adaptiveBuckets) {
+				// the AA pass only costs where there are pixels to antialias; each of them shoots four more
+				// rays, so it costs about four times what it took in the first pass:
+				CostMap aaCosts;
+				aaCosts.reset(W, H);
+				for (int i = 0; i < (int) buckets.size(); i++) {
+					const Rect& r = buckets[i];
+					double pixelCost = 4 * task1.times[i] / (r.w * r.h);
+					for (int y = r.y0; y < r.y1; y++)
+						for (int x = r.x0; x < r.x1; x++)
+							if (needsAA[y][x])
+								aaCosts.record(Rect(x, y, x + 1, y + 1), pixelCost);
+				}
+				buckets = getBucketsList(scene.settings.bucketSize);
+				scheduleBuckets(buckets, aaCosts, scene.settings.numThreads);
+			}
 			TaskAA task2(buckets);
-			pool.run(&task2, scene.settings.numThreads);
+			threadPool.parallel_for(buckets.size(), &task2, scene.settings.numThreads);
 		}
 	}
 }
 
+/// renders a single work unit of a distributed render (see distributed.h), using all threads.
+/// The results are left in vfb.
+void renderBucket(const Rect& r)
+{
+	// the AA detection needs the pixels around the bucket as well, so they are rendered, too:
+	Rect outer(max(0, r.x0 - 1), max(0, r.y0 - 1), r.x1 + 1, r.y1 + 1);
+	outer.clip(frameWidth(), frameHeight());
+	
+	// each thread gets a row of the bucket:
+	vector<Rect> rows;
+	for (int y = outer.y0; y < outer.y1; y++)
+		rows.push_back(Rect(outer.x0, y, outer.x1, y + 1));
+	TaskNoAA task1(rows);
+	threadPool.parallel_for(rows.size(), &task1, scene.settings.numThreads);
+	
+	if (scene.settings.wantAA && !scene.camera->dof && !scene.settings.gi) {
+		findAAPixels(r);
+		rows.clear();
+		for (int y = r.y0; y < r.y1; y++)
+			rows.push_back(Rect(r.x0, y, r.x1, y + 1));
+		TaskAA task2(rows);
+		threadPool.parallel_for(rows.size(), &task2, scene.settings.numThreads);
+	}
+}
+
 int renderSceneThread(void* /*unused*/)
 {
 	scene.beginFrame();
@@ -453,25 +818,46 @@ void handleMouse(SDL_MouseButtonEvent *mev)
 {
 	if (mev->button != 1) return; // only consider the left mouse button
 	printf("Mouse click from (%d, %d)\n", (int) mev->x, (int) mev->y);
+	getSampler().beginSample(sampleKey(mev->x), sampleKey(mev->y), 0);
 	Ray ray = scene.camera->getScreenRay(mev->x, mev->y);
 	ray.flags |= RF_DEBUG;
 	if (scene.settings.gi)
-		pathtrace(ray, Color(1, 1, 1), getRandomGen());
+		pathtrace(ray, Color(1, 1, 1), getSampler());
 	else
 		raytrace(ray);
 	printf("Raytracing completed!\n");
 }
 
-const char* defaultScene = "data/boxed.trinity";
-
 static bool parseCmdLine(int argc, char** argv)
 {
-	if (argc < 2) return true;
-	if (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) {
-		printf("Usage: retrace [scenefile]\n");
-		return false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			printf("Usage: trinity [--headless <output.bmp|output.exr>] [--workers <count>] [scenefile]\n");
+			return false;
+		}
+		if (!strcmp(argv[i], "--workers") || !strcmp(argv[i], "--worker")) {
+			if (i + 1 >= argc) {
+				printf("%s needs a number\n", argv[i]);
+				return false;
+			}
+			if (!strcmp(argv[i], "--worker")) {
+				workerMode = true;
+				workerThreads = atoi(argv[++i]);
+			} else {
+				numWorkers = max(0, atoi(argv[++i]));
+			}
+			continue;
+		}
+		if (!strcmp(argv[i], "--headless")) {
+			if (i + 1 >= argc) {
+				printf("--headless needs an output file name\n");
+				return false;
+			}
+			headlessOutput = argv[++i];
+			continue;
+		}
+		defaultScene = argv[i];
 	}
-	defaultScene = argv[1];
 	return true;
 }
 
@@ -567,18 +953,56 @@ void mainloop(void)
 int main(int argc, char** argv)
 {
 	if (!parseCmdLine(argc, argv)) return 0;
-	initRandom((Uint32) time(NULL));
+	initDistributed(argv[0]);
+	if (workerMode) initWorker();
+	Uint32 seed = (Uint32) time(NULL);
+	initRandom(seed);
 	initColor();
 	if (!scene.parseScene(defaultScene)) {
 		printf("Could not parse the scene!\n");
 		return -1;
 	}
+	initSamplers(scene.settings.sampler, seed);
+	if (workerMode && workerThreads > 0)
+		scene.settings.numThreads = workerThreads;
+	if (numWorkers > 0 && scene.settings.numThreads == 0)
+		workerThreads = max(1, get_processor_count() / numWorkers); // share the machine between the workers
+	else
+		workerThreads = scene.settings.numThreads;
 	if (scene.settings.numThreads == 0)
 		scene.settings.numThreads = get_processor_count();
+	if (headlessOutput || numWorkers > 0 || workerMode)
+		scene.settings.interactive = false;
 	if (scene.settings.interactive) 
 		scene.settings.wantAA = scene.settings.wantPrepass = false;
 	bool fullscreen = scene.settings.interactive && scene.settings.fullscreen;
 	
+	vfb.resize(scene.settings.frameWidth, scene.settings.frameHeight);
+	vfb.clear(Color(0, 0, 0));
+	needsAA.resize(scene.settings.frameWidth, scene.settings.frameHeight);
+	needsAA.clear(false);
+	sampleCount.resize(scene.settings.frameWidth, scene.settings.frameHeight);
+	sampleCount.clear(0);
+	
+	if (workerMode) {
+		// render buckets for a coordinator, until it closes our stdin
+		initHeadless(scene.settings.frameWidth, scene.settings.frameHeight);
+		scene.beginRender();
+		scene.beginFrame();
+		return runWorker();
+	}
+	
+	if (headlessOutput) {
+		// batch mode: no window, just render and save the image
+		initHeadless(scene.settings.frameWidth, scene.settings.frameHeight);
+		scene.beginRender();
+		double startTime = getPreciseTime();
+		scene.beginFrame();
+		renderScene();
+		printf("Render time: %.2f seconds.\n", getPreciseTime() - startTime);
+		return takeScreenshot(headlessOutput) ? 0 : -1;
+	}
+	
 	if (!initGraphics(scene.settings.frameWidth, scene.settings.frameHeight, fullscreen)) return -1;
 	scene.beginRender();
 	if (scene.settings.interactive) {
@@ -28,34 +28,190 @@
 #include "constants.h"
 #include "color.h"
 #include "bbox.h"
+#include "cxxptl_sdl.h"
+#if defined(__SSE__) && !defined(TRINITY_NO_SIMD)
+#	define USE_SSE
+#	include <xmmintrin.h>
+#endif
 using std::max;
+using std::min;
 using std::string;
 using std::vector;
 using std::swap;
 
+// statistics about a built KD-tree; areas are the sum of surface areas of the respective nodes' bboxen
+struct KDTreeStats {
+	int nodes, leaves, emptyLeaves;
+	int triangleRefs;
+	double inNodeArea;   //!< sum of areas of all in-nodes
+	double leafCostArea; //!< sum of (area * number of triangles) of all leaves
+	KDTreeStats() { nodes = leaves = emptyLeaves = triangleRefs = 0; inNodeArea = leafCostArea = 0; }
+};
+
+static void gatherStats(const vector<KDNode>& nodes, int index, const BBox& bbox, KDTreeStats& stats)
+{
+	const KDNode& node = nodes[index];
+	stats.nodes++;
+	if (node.isLeaf()) {
+		int n = node.numTriangles();
+		stats.leaves++;
+		if (!n) stats.emptyLeaves++;
+		stats.triangleRefs += n;
+		stats.leafCostArea += bbox.area() * n;
+	} else {
+		stats.inNodeArea += bbox.area();
+		BBox bbLeft, bbRight;
+		bbox.split(node.axis(), node.splitPos, bbLeft, bbRight);
+		gatherStats(nodes, index + 1, bbLeft, stats);
+		gatherStats(nodes, node.rightChild(), bbRight, stats);
+	}
+}
+
 void Mesh::initMesh(void)
 {
 	// calculate a bounding box around the mesh:
 	boundingBox.makeEmpty();
 	for (int i = 1; i < (int) vertices.size(); i++)
 		boundingBox.add(vertices[i]);
-	kdroot = NULL;
-	if (triangles.size() > 40 && useKDTree) {
-		kdroot = new KDTreeNode;
+	kdNodes.clear();
+	kdTriangles.clear();
+	kdBlocks.clear();
+}
+
+/// a subtree of the K-d tree, which is yet to be built
+struct KDBuildJob {
+	KDTreeNode* node;
+	BBox bbox;
+	vector<int> triangles;
+	int depth;
+};
+
+/// Builds a K-d tree on multiple threads. Each thread takes a pending subtree from a shared list and
+/// builds it; large enough subtrees of it are put back to the list, instead of being built in place.
+/// Idle threads sleep on a condition variable, until a job is added, or the whole tree is done.
+class KDBuildTask: public Parallel {
+	Mesh& mesh;
+	SDL_mutex* lock;
+	SDL_cond* changed; //!< signalled when a job is added, or when the last job completes
+	vector<KDBuildJob*> jobs;
+	int pending; //!< the number of jobs, that are either waiting in `jobs', or are being built
+public:
+	KDBuildTask(Mesh& mesh): mesh(mesh), pending(0)
+	{
+		lock = SDL_CreateMutex();
+		changed = SDL_CreateCond();
+	}
+	~KDBuildTask()
+	{
+		SDL_DestroyCond(changed);
+		SDL_DestroyMutex(lock);
+	}
+	
+	void addJob(KDTreeNode* node, const BBox& bbox, vector<int>& triangles, int depth)
+	{
+		KDBuildJob* job = new KDBuildJob;
+		job->node = node;
+		job->bbox = bbox;
+		job->triangles.swap(triangles);
+		job->depth = depth;
+		SDL_LockMutex(lock);
+		pending++;
+		jobs.push_back(job);
+		SDL_UnlockMutex(lock);
+		SDL_CondSignal(changed);
+	}
+	
+	void entry(int threadIndex, int threadCount)
+	{
+		SDL_LockMutex(lock);
+		while (true) {
+			// someone's still building; they may yet add more jobs:
+			while (jobs.empty() && pending > 0)
+				SDL_CondWait(changed, lock);
+			if (jobs.empty()) break; // all done
+			KDBuildJob* job = jobs.back();
+			jobs.pop_back();
+			SDL_UnlockMutex(lock);
+			mesh.build(*job->node, job->bbox, job->triangles, job->depth, this);
+			delete job;
+			SDL_LockMutex(lock);
+			if (--pending == 0)
+				SDL_CondBroadcast(changed); // wake up the idle threads, so they can exit
+		}
+		SDL_UnlockMutex(lock);
+	}
+};
+
+void Mesh::beginRender()
+{
+	if (triangles.size() > 40 && useKDTree && kdNodes.empty()) {
+		KDTreeNode* root = new KDTreeNode;
 		Uint32 ticks = SDL_GetTicks();
 		vector<int> allTriangles;
 		for (int i = 0; i < (int) triangles.size(); i++)
 			allTriangles.push_back(i);
-		build(*kdroot, boundingBox, allTriangles, 0);
+		int numThreads = scene.settings.numThreads;
+		if (numThreads > 1 && (int) triangles.size() >= KD_PARALLEL_BUILD_THRESHOLD) {
+			KDBuildTask task(*this);
+			task.addJob(root, boundingBox, allTriangles, 0);
+			threadPool.run(&task, numThreads);
+		} else {
+			numThreads = 1;
+			build(*root, boundingBox, allTriangles, 0, NULL);
+		}
+		flatten(*root);
+		delete root;
+		packTriangles();
 		Uint32 timeElapsed = SDL_GetTicks() - ticks;
-		printf("KDtree built: %d triangles in %d ms\n", 
-			(int) allTriangles.size(), timeElapsed);
+		printf("KDtree built: %d triangles in %d ms (%d thread%s)\n", 
+			(int) triangles.size(), timeElapsed, numThreads, numThreads > 1 ? "s" : "");
+		KDTreeStats stats;
+		gatherStats(kdNodes, 0, boundingBox, stats);
+		printf("KDtree (%s): %d nodes, %d leaves (%d empty), %.2f triangles/leaf, expected cost %.2f, %d KB\n",
+			useSAH ? "SAH" : "midpoint", stats.nodes, stats.leaves, stats.emptyLeaves,
+			stats.leaves ? stats.triangleRefs / (double) stats.leaves : 0.0,
+			(sahTraversalCost * stats.inNodeArea + sahIntersectCost * stats.leafCostArea) / boundingBox.area(),
+			(int) ((kdNodes.size() * sizeof(KDNode) + kdTriangles.size() * sizeof(int) +
+			        kdBlocks.size() * sizeof(TriangleBlock)) / 1024));
+	}
+}
+
+void Mesh::flatten(const KDTreeNode& node)
+{
+	int index = (int) kdNodes.size();
+	kdNodes.push_back(KDNode());
+	if (node.axis == AXIS_NONE) {
+		// align the list to 4 triangles, so that it starts at a TriangleBlock boundary:
+		while (kdTriangles.size() % 4) kdTriangles.push_back(-1);
+		kdNodes[index].initLeaf((int) kdTriangles.size(), (int) node.triangles->size());
+		kdTriangles.insert(kdTriangles.end(), node.triangles->begin(), node.triangles->end());
+	} else {
+		kdNodes[index].initBinary(node.axis, (float) node.splitPos);
+		flatten(node.children[0]); // the left child goes right after its parent
+		kdNodes[index].setRightChild((int) kdNodes.size());
+		flatten(node.children[1]);
 	}
 }
 
-Mesh::~Mesh()
+void Mesh::packTriangles(void)
 {
-	if (kdroot) delete kdroot;
+	while (kdTriangles.size() % 4) kdTriangles.push_back(-1);
+	kdBlocks.resize(kdTriangles.size() / 4);
+	blockOrigin = (boundingBox.vmin + boundingBox.vmax) * 0.5;
+	for (int i = 0; i < (int) kdTriangles.size(); i++) {
+		TriangleBlock& block = kdBlocks[i / 4];
+		int lane = i % 4;
+		Vector A(0, 0, 0), AB(0, 0, 0), AC(0, 0, 0); // (unused lanes are filled with a degenerate triangle)
+		if (kdTriangles[i] >= 0) {
+			const Triangle& T = triangles[kdTriangles[i]];
+			A = vertices[T.v[0]] - blockOrigin;
+			AB = T.AB;
+			AC = T.AC;
+		}
+		block.ax[lane] = (float) A.x;   block.ay[lane] = (float) A.y;   block.az[lane] = (float) A.z;
+		block.abx[lane] = (float) AB.x; block.aby[lane] = (float) AB.y; block.abz[lane] = (float) AB.z;
+		block.acx[lane] = (float) AC.x; block.acy[lane] = (float) AC.y; block.acz[lane] = (float) AC.z;
+	}
 }
 
 const char* Mesh::getName()
@@ -65,6 +221,14 @@ const char* Mesh::getName()
 	return temp;
 }
 
+// the tolerance for the barycentric coordinates in the ray-triangle tests. With doubles, no tolerance is needed, but
+// with floats, a ray that hits an edge, shared by two triangles, may slip through both of them due to roundoff:
+#ifdef TRINITY_SINGLE_PRECISION
+const double BARYCENTRIC_EPSILON = 1e-6;
+#else
+const double BARYCENTRIC_EPSILON = 0;
+#endif
+
 bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, const Vector& C, double& dist)
 {
 	Vector AB = B - A;
@@ -98,7 +262,8 @@ bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, con
 	if (gamma < 0 || gamma > dist) return false;
 
 	// is the intersection outside the triangle?
-	if (lambda2 < 0 || lambda2 > 1 || lambda3 < 0 || lambda3 > 1 || lambda2 + lambda3 > 1)
+	if (lambda2 < -BARYCENTRIC_EPSILON || lambda2 > 1 + BARYCENTRIC_EPSILON ||
+	    lambda3 < -BARYCENTRIC_EPSILON || lambda3 > 1 + BARYCENTRIC_EPSILON || lambda2 + lambda3 > 1 + BARYCENTRIC_EPSILON)
 		return false;
 
 	dist = gamma;
@@ -108,14 +273,9 @@ bool intersectTriangleFast(const Ray& ray, const Vector& A, const Vector& B, con
 }
 
 
-bool Mesh::intersectTriangle(const RRay& ray, IntersectionData& data, Triangle& T)
+inline bool Mesh::hitTriangle(const RRay& ray, const Triangle& T, double maxDist,
+                              double& gamma, double& lambda2, double& lambda3) const
 {
-	// (backface culling needs to be disabled when we trace shadow rays, otherwise we may find light
-	//  in places there shouldn't be one).
-	if (backfaceCulling && !(ray.flags & RF_SHADOW)) {
-		bool inSameDirection = (dot(ray.dir, T.gnormal) > 0);
-		if (inSameDirection) return false; // backface culling
-	}
 	//              B                     A
 //	Vector AB = vertices[T.v[1]] - vertices[T.v[0]];
 //	Vector AC = vertices[T.v[2]] - vertices[T.v[0]];
@@ -142,24 +302,47 @@ bool Mesh::intersectTriangle(const RRay& ray, IntersectionData& data, Triangle&
 	double rDcr = 1/Dcr;
 	
 	//double gamma   = ( (AB ^ AC) * H ) * rDcr;
-	double gamma   = ( T.ABcrossAC * H ) * rDcr;
+	gamma   = ( T.ABcrossAC * H ) * rDcr;
 	// is intersection behind us, or too far?
-	if (gamma < 0 || gamma > data.dist) return false;
+	if (gamma < 0 || gamma > maxDist) return false;
 
-	double lambda2 = ( ( H ^ T.AC) * D ) * rDcr;
-	double lambda3 = ( (T.AB ^  H) * D ) * rDcr;
+	lambda2 = ( ( H ^ T.AC) * D ) * rDcr;
+	lambda3 = ( (T.AB ^  H) * D ) * rDcr;
 
 	
 	// is the intersection outside the triangle?
-	if (lambda2 < 0 || lambda2 > 1 || lambda3 < 0 || lambda3 > 1 || lambda2 + lambda3 > 1)
+	if (lambda2 < -BARYCENTRIC_EPSILON || lambda2 > 1 + BARYCENTRIC_EPSILON ||
+	    lambda3 < -BARYCENTRIC_EPSILON || lambda3 > 1 + BARYCENTRIC_EPSILON || lambda2 + lambda3 > 1 + BARYCENTRIC_EPSILON)
 		return false;
-	//
+	return true;
+}
+
+inline bool Mesh::intersectTriangle(const RRay& ray, IntersectionData& data, int triIdx)
+{
+	const Triangle& T = triangles[triIdx];
+	// (backface culling needs to be disabled when we trace shadow rays, otherwise we may find light
+	//  in places there shouldn't be one).
+	if (backfaceCulling && !(ray.flags & RF_SHADOW)) {
+		bool inSameDirection = (dot(ray.dir, T.gnormal) > 0);
+		if (inSameDirection) return false; // backface culling
+	}
+	double gamma, lambda2, lambda3;
+	if (!hitTriangle(ray, T, data.dist, gamma, lambda2, lambda3)) return false;
 	
 	// intersection found, and it's closer to the current one in data.
-	// store intersection point.
-	data.p = ray.start + ray.dir * gamma;
+	// Just record it; the rest is computed in fillSurfaceData(), if this remains the closest hit:
 	data.dist = gamma;
-	data.g = this;
+	data.primitive = triIdx;
+	data.lambda2 = lambda2;
+	data.lambda3 = lambda3;
+	return true;
+}
+
+void Mesh::fillSurfaceData(const Ray& ray, IntersectionData& data)
+{
+	const Triangle& T = triangles[data.primitive];
+	double lambda2 = data.lambda2, lambda3 = data.lambda3;
+	data.p = ray.start + ray.dir * data.dist;
 	
 	double lambda1 = 1 - lambda2 - lambda3;
 	if (faceted || !hasNormals) {
@@ -180,74 +363,475 @@ bool Mesh::intersectTriangle(const RRay& ray, IntersectionData& data, Triangle&
 	data.v = uv.y;
 	data.dNdx = T.dNdx;
 	data.dNdy = T.dNdy;
-	return true;
 }
 
-bool Mesh::intersectKD(KDTreeNode& node, const BBox& bbox, const RRay& ray, IntersectionData& data)
+/// a ray, converted to single precision, for use with testTriangleBlock(). The origin is taken relative to
+/// Mesh::blockOrigin (in double precision), just like the vertices of the TriangleBlock's
+struct FloatRay {
+	float org[3], dir[3];
+	FloatRay() {}
+	FloatRay(const Ray& ray, const Vector& origin)
+	{
+		for (int i = 0; i < 3; i++) {
+			org[i] = (float) (ray.start[i] - origin[i]);
+			dir[i] = (float) ray.dir[i];
+		}
+	}
+};
+
+// tolerances for testTriangleBlock(), large enough to cover its roundoff errors:
+const float BLOCK_BARY_EPS = 1e-3f; // ... of the barycentric coordinates
+const float BLOCK_DIST_EPS = 1e-4f; // ... of the distance (relative)
+// ... and the relative roundoff of a few float operations, which is scaled by the magnitudes of their operands:
+const float BLOCK_REL_EPS = 2e-6f;
+
+/// the terms of the ray-TriangleBlock test, which only depend on the ray's origin; rays with a common
+/// origin (e.g., the primary rays in a packet) can share them.
+struct BlockOriginTerms {
+#ifdef USE_SSE
+	__m128 tx, ty, tz; // T = org - A
+	__m128 qx, qy, qz; // Q = T ^ AB
+	__m128 tq;         // AC * Q
+	__m128 tAbs, qAbs, tqAbs; // the magnitudes of the above (upper bounds, including the rounding of org and A)
+#else
+	float tx[4], ty[4], tz[4];
+	float qx[4], qy[4], qz[4];
+	float tq[4];
+	float tAbs[4], qAbs[4], tqAbs[4];
+#endif
+};
+
+#ifdef USE_SSE
+// returns |x| + |y| + |z|, for each of the four lanes
+static inline __m128 sumAbs(__m128 x, __m128 y, __m128 z)
+{
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	return _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, x), _mm_andnot_ps(signMask, y)), _mm_andnot_ps(signMask, z));
+}
+#endif
+
+static inline void getBlockOriginTerms(const TriangleBlock& b, const float org[3], BlockOriginTerms& o)
 {
-	if (node.axis == AXIS_NONE) {
-		// leaf node; try intersecting with the triangle list:
-		bool found = false;
-		for (size_t i = 0; i < node.triangles->size(); i++) {
-			int triIdx = (*node.triangles)[i];
-			if (intersectTriangle(ray, data, triangles[triIdx])) {
+	float orgAbs = fabs(org[0]) + fabs(org[1]) + fabs(org[2]);
+#ifdef USE_SSE
+	__m128 ax = _mm_loadu_ps(b.ax), ay = _mm_loadu_ps(b.ay), az = _mm_loadu_ps(b.az);
+	__m128 e1x = _mm_loadu_ps(b.abx), e1y = _mm_loadu_ps(b.aby), e1z = _mm_loadu_ps(b.abz);
+	__m128 e2x = _mm_loadu_ps(b.acx), e2y = _mm_loadu_ps(b.acy), e2z = _mm_loadu_ps(b.acz);
+	o.tx = _mm_sub_ps(_mm_set1_ps(org[0]), ax);
+	o.ty = _mm_sub_ps(_mm_set1_ps(org[1]), ay);
+	o.tz = _mm_sub_ps(_mm_set1_ps(org[2]), az);
+	o.qx = _mm_sub_ps(_mm_mul_ps(o.ty, e1z), _mm_mul_ps(o.tz, e1y));
+	o.qy = _mm_sub_ps(_mm_mul_ps(o.tz, e1x), _mm_mul_ps(o.tx, e1z));
+	o.qz = _mm_sub_ps(_mm_mul_ps(o.tx, e1y), _mm_mul_ps(o.ty, e1x));
+	o.tq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, o.qx), _mm_mul_ps(e2y, o.qy)), _mm_mul_ps(e2z, o.qz));
+	// T's error depends on |org| and |A|, not just on |T| (the difference may cancel out):
+	o.tAbs = _mm_add_ps(_mm_add_ps(sumAbs(o.tx, o.ty, o.tz), sumAbs(ax, ay, az)), _mm_set1_ps(orgAbs));
+	o.qAbs = _mm_mul_ps(o.tAbs, sumAbs(e1x, e1y, e1z));
+	o.tqAbs = _mm_mul_ps(o.qAbs, sumAbs(e2x, e2y, e2z));
+#else
+	for (int i = 0; i < 4; i++) {
+		o.tx[i] = org[0] - b.ax[i];
+		o.ty[i] = org[1] - b.ay[i];
+		o.tz[i] = org[2] - b.az[i];
+		o.qx[i] = o.ty[i] * b.abz[i] - o.tz[i] * b.aby[i];
+		o.qy[i] = o.tz[i] * b.abx[i] - o.tx[i] * b.abz[i];
+		o.qz[i] = o.tx[i] * b.aby[i] - o.ty[i] * b.abx[i];
+		o.tq[i] = b.acx[i] * o.qx[i] + b.acy[i] * o.qy[i] + b.acz[i] * o.qz[i];
+		o.tAbs[i] = fabs(o.tx[i]) + fabs(o.ty[i]) + fabs(o.tz[i]) +
+		            fabs(b.ax[i]) + fabs(b.ay[i]) + fabs(b.az[i]) + orgAbs;
+		o.qAbs[i] = o.tAbs[i] * (fabs(b.abx[i]) + fabs(b.aby[i]) + fabs(b.abz[i]));
+		o.tqAbs[i] = o.qAbs[i] * (fabs(b.acx[i]) + fabs(b.acy[i]) + fabs(b.acz[i]));
+	}
+#endif
+}
+
+/**
+ * Tests a ray against the four triangles of a TriangleBlock (using the Moller-Trumbore algorithm).
+ * The computations are in single precision and the tolerances are loose, so a triangle may come out
+ * as hit, even if it's just very near the ray; the result is thus only a list of candidates, that
+ * must be checked precisely, with intersectTriangle() or hitTriangle(). Besides the fixed BLOCK_*_EPS,
+ * the tolerances grow with the magnitudes of the operands (over the determinant), so that the test stays
+ * conservative for large coordinates, or for rays, that start far away from the triangle.
+ *
+ * @param o - the terms, that depend on the ray's origin (see getBlockOriginTerms())
+ * @returns a bitmask of the candidate triangles (bit i is set, if the i-th triangle may be hit closer than maxDist)
+ */
+static inline int testTriangleBlock(const TriangleBlock& b, const BlockOriginTerms& o, const float dir[3], double maxDist)
+{
+	float maxT = (float) min(maxDist * (1 + BLOCK_DIST_EPS) + BLOCK_DIST_EPS, 1e30);
+	float dirAbs = fabs(dir[0]) + fabs(dir[1]) + fabs(dir[2]);
+#ifdef USE_SSE
+	__m128 dx = _mm_set1_ps(dir[0]), dy = _mm_set1_ps(dir[1]), dz = _mm_set1_ps(dir[2]);
+	__m128 e1x = _mm_loadu_ps(b.abx), e1y = _mm_loadu_ps(b.aby), e1z = _mm_loadu_ps(b.abz);
+	__m128 e2x = _mm_loadu_ps(b.acx), e2y = _mm_loadu_ps(b.acy), e2z = _mm_loadu_ps(b.acz);
+	// P = dir ^ AC; det = AB * P:
+	__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	// the ray is (nearly) parallel to the triangle: leave it to the precise test
+	__m128 absDet = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+	__m128 parallel = _mm_cmplt_ps(absDet, _mm_set1_ps(1e-12f));
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 invDet = _mm_div_ps(one, _mm_or_ps(_mm_and_ps(parallel, one), _mm_andnot_ps(parallel, det)));
+	// u = (T * P) / det; v = (dir * Q) / det; t = (AC * Q) / det:
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(o.tx, px), _mm_mul_ps(o.ty, py)), _mm_mul_ps(o.tz, pz)), invDet);
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, o.qx), _mm_mul_ps(dy, o.qy)), _mm_mul_ps(dz, o.qz)), invDet);
+	__m128 t = _mm_mul_ps(o.tq, invDet);
+	// the roundoff errors of u, v, t (the error of det affects all three, in proportion):
+	__m128 pAbs = _mm_mul_ps(_mm_set1_ps(dirAbs), sumAbs(e2x, e2y, e2z));
+	__m128 rel = _mm_mul_ps(_mm_set1_ps(BLOCK_REL_EPS), _mm_andnot_ps(_mm_set1_ps(-0.0f), invDet));
+	__m128 detErr = _mm_mul_ps(rel, _mm_mul_ps(sumAbs(e1x, e1y, e1z), pAbs));
+	__m128 uTol = _mm_add_ps(_mm_set1_ps(BLOCK_BARY_EPS), _mm_add_ps(_mm_mul_ps(rel, _mm_mul_ps(o.tAbs, pAbs)), detErr));
+	__m128 vTol = _mm_add_ps(_mm_set1_ps(BLOCK_BARY_EPS),
+	                         _mm_add_ps(_mm_mul_ps(rel, _mm_mul_ps(_mm_set1_ps(dirAbs), o.qAbs)), detErr));
+	__m128 tTol = _mm_add_ps(_mm_set1_ps(BLOCK_DIST_EPS), _mm_add_ps(_mm_mul_ps(rel, o.tqAbs),
+	                         _mm_mul_ps(detErr, _mm_andnot_ps(_mm_set1_ps(-0.0f), t))));
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(u, _mm_sub_ps(_mm_setzero_ps(), uTol)),
+	                        _mm_cmpge_ps(v, _mm_sub_ps(_mm_setzero_ps(), vTol)));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(u, v), _mm_add_ps(one, _mm_add_ps(uTol, vTol))));
+	hit = _mm_and_ps(hit, _mm_cmpge_ps(t, _mm_sub_ps(_mm_setzero_ps(), tTol)));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(t, _mm_add_ps(_mm_set1_ps(maxT), tTol)));
+	return _mm_movemask_ps(_mm_or_ps(hit, parallel));
+#else
+	int mask = 0;
+	for (int i = 0; i < 4; i++) {
+		float px = dir[1] * b.acz[i] - dir[2] * b.acy[i];
+		float py = dir[2] * b.acx[i] - dir[0] * b.acz[i];
+		float pz = dir[0] * b.acy[i] - dir[1] * b.acx[i];
+		float det = b.abx[i] * px + b.aby[i] * py + b.abz[i] * pz;
+		if (fabs(det) < 1e-12f) {
+			mask |= 1 << i;
+			continue;
+		}
+		float invDet = 1.0f / det;
+		float u = (o.tx[i] * px + o.ty[i] * py + o.tz[i] * pz) * invDet;
+		float v = (dir[0] * o.qx[i] + dir[1] * o.qy[i] + dir[2] * o.qz[i]) * invDet;
+		float t = o.tq[i] * invDet;
+		float pAbs = dirAbs * (fabs(b.acx[i]) + fabs(b.acy[i]) + fabs(b.acz[i]));
+		float rel = BLOCK_REL_EPS * fabs(invDet);
+		float detErr = rel * (fabs(b.abx[i]) + fabs(b.aby[i]) + fabs(b.abz[i])) * pAbs;
+		float uTol = BLOCK_BARY_EPS + rel * o.tAbs[i] * pAbs + detErr;
+		float vTol = BLOCK_BARY_EPS + rel * dirAbs * o.qAbs[i] + detErr;
+		float tTol = BLOCK_DIST_EPS + rel * o.tqAbs[i] + detErr * fabs(t);
+		if (u >= -uTol && v >= -vTol && u + v <= 1 + uTol + vTol &&
+		    t >= -tTol && t <= maxT + tTol)
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
+
+static inline int testTriangleBlock(const TriangleBlock& b, const FloatRay& ray, double maxDist)
+{
+	BlockOriginTerms o;
+	getBlockOriginTerms(b, ray.org, o);
+	return testTriangleBlock(b, o, ray.dir, maxDist);
+}
+
+// intersects the ray with the triangles of a KD-tree leaf, four triangles at a time
+inline bool Mesh::intersectLeaf(const RRay& ray, const FloatRay& fray, IntersectionData& data, const KDNode& node)
+{
+	bool found = false;
+	const int* triList = kdTriangles.data() + node.firstTriangle;
+	const TriangleBlock* blocks = kdBlocks.data() + node.firstTriangle / 4;
+	for (int i = 0, n = node.numTriangles(); i < n; i += 4) {
+		int mask = testTriangleBlock(blocks[i / 4], fray, data.dist);
+		for (int lane = 0; lane < 4 && i + lane < n; lane++)
+			if ((mask & (1 << lane)) && intersectTriangle(ray, data, triList[i + lane]))
 				found = true;
+	}
+	return found;
+}
+
+// intersectLeaf() for the rays of a packet, which all start at the same point. The terms of the
+// ray-triangle test, that depend on the origin only, are computed once for all rays.
+inline int Mesh::intersectLeafCommonOrigin(const RayPacket& packet, const FloatRay frays[], IntersectionData data[],
+                                           const KDNode& node, int mask)
+{
+	int found = 0;
+	const int* triList = kdTriangles.data() + node.firstTriangle;
+	const TriangleBlock* blocks = kdBlocks.data() + node.firstTriangle / 4;
+	int first = 0;
+	while (!(mask & (1 << first))) first++;
+	for (int i = 0, n = node.numTriangles(); i < n; i += 4) {
+		BlockOriginTerms o;
+		getBlockOriginTerms(blocks[i / 4], frays[first].org, o);
+		for (int r = 0; r < PACKET_SIZE; r++) if (mask & (1 << r)) {
+			int candidates = testTriangleBlock(blocks[i / 4], o, frays[r].dir, data[r].dist);
+			for (int lane = 0; lane < 4 && i + lane < n; lane++)
+				if ((candidates & (1 << lane)) && intersectTriangle(packet.rays[r], data[r], triList[i + lane]))
+					found |= 1 << r;
+		}
+	}
+	return found;
+}
+
+bool Mesh::intersectKD(const RRay& ray, IntersectionData& data, double tmin, double tmax)
+{
+	// front-to-back traversal of the tree. Each node is visited along with the [tmin, tmax] interval
+	// of the ray, which lies within the node's box. The children that are to be visited later are
+	// kept in a stack:
+	struct StackEntry {
+		int node;
+		double tmin, tmax;
+	} stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	bool found = false;
+	int index = 0;
+	FloatRay fray(ray, blockOrigin);
+	
+	while (true) {
+		// if we already have a hit, which is closer than the current interval, we're done:
+		if (data.dist < tmin) break;
+		const KDNode& node = kdNodes[index];
+		if (!node.isLeaf()) {
+			Axis axis = node.axis();
+			double splitPos = node.splitPos;
+			// where does the ray cross the splitting plane:
+			double tSplit = (splitPos - ray.start[axis]) * ray.rdir[axis];
+			// the child where the ray starts in is the "near" one:
+			bool leftFirst = ray.start[axis] < splitPos || (ray.start[axis] == splitPos && ray.dir[axis] <= 0);
+			int nearChild = leftFirst ? index + 1 : node.rightChild();
+			int farChild  = leftFirst ? node.rightChild() : index + 1;
+			if (tSplit > tmax || tSplit <= 0) {
+				// the ray doesn't reach the plane within the interval; only the near child is hit:
+				index = nearChild;
+			} else if (tSplit < tmin) {
+				// the ray crosses the plane before the interval; only the far child is hit:
+				index = farChild;
+			} else {
+				stack[sp].node = farChild;
+				stack[sp].tmin = tSplit;
+				stack[sp].tmax = tmax;
+				sp++;
+				index = nearChild;
+				tmax = tSplit;
 			}
+		} else {
+			// leaf node; try intersecting with the triangle list:
+			if (intersectLeaf(ray, fray, data, node))
+				found = true;
+			// the found intersection has to be inside the current leaf, otherwise we might miss a
+			// triangle (in a leaf, that's yet to be visited):
+			if (data.dist <= tmax) break;
+			if (!sp) break;
+			sp--;
+			index = stack[sp].node;
+			tmin = stack[sp].tmin;
+			tmax = stack[sp].tmax;
 		}
-		// the found intersection has to be inside "our" BBox, otherwise we can miss a triangle,
-		// as explained in the presentations:
-		if (found && bbox.inside(data.p)) return true;
-		return false;
-	} else {
-		// a in-node; intersect with the two children, starting with the closer one first:
-		int childOrder[2] = { 0, 1 };
-		if (ray.start[node.axis] > node.splitPos)
-			swap(childOrder[0], childOrder[1]);
-		// 
-		BBox childBB[2];
-		bbox.split(node.axis, node.splitPos, childBB[0], childBB[1]);
-		// name the children bboxen:
-		BBox& firstBB = childBB[childOrder[0]];
-		BBox& secondBB = childBB[childOrder[1]];
-		KDTreeNode& firstChild = node.children[childOrder[0]];
-		KDTreeNode& secondChild = node.children[childOrder[1]];
-		// if the ray intersects the common wall between the two sub-boxes, then it invariably
-		// intersects both boxes (we can skip the testIntersect() checks):
-		// (see http://raytracing-bg.net/?q=node/68 )
-		if (bbox.intersectWall(node.axis, node.splitPos, ray)) {
-			if (intersectKD(firstChild, firstBB, ray, data)) return true;
-			return intersectKD(secondChild, secondBB, ray, data);
+	}
+	return found;
+}
+
+int Mesh::intersectKDPacket(const RayPacket& packet, IntersectionData data[], double tmin[], double tmax[], int mask)
+{
+	// the same as intersectKD(), but every ray has its own interval. A node is visited if any of the
+	// rays needs it, and `mask' tracks which ones do. Since all rays go in the same directions, the
+	// "near" child is the same for all of them.
+	struct StackEntry {
+		int node, mask;
+		double tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+	} stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	int found = 0;
+	int index = 0;
+	int alive = mask; // the rays, that can still find a closer hit
+	int first = 0;
+	while (!(mask & (1 << first))) first++;
+	const RRay& firstRay = packet.rays[first];
+	FloatRay frays[PACKET_SIZE];
+	bool commonOrigin = true;
+	for (int i = 0; i < PACKET_SIZE; i++) if (mask & (1 << i)) {
+		frays[i] = FloatRay(packet.rays[i], blockOrigin);
+		const Vector& org = packet.rays[i].start;
+		if (org.x != firstRay.start.x || org.y != firstRay.start.y || org.z != firstRay.start.z)
+			commonOrigin = false;
+	}
+	
+	while (true) {
+		// the rays, that already have a hit, closer than their current interval, are done:
+		for (int i = 0; i < PACKET_SIZE; i++)
+			if ((mask & (1 << i)) && data[i].dist < tmin[i])
+				alive &= ~(1 << i);
+		mask &= alive;
+		if (mask) {
+			const KDNode& node = kdNodes[index];
+			if (!node.isLeaf()) {
+				Axis axis = node.axis();
+				double splitPos = node.splitPos;
+				bool leftFirst = firstRay.rdir[axis] > 0;
+				int nearChild = leftFirst ? index + 1 : node.rightChild();
+				int farChild  = leftFirst ? node.rightChild() : index + 1;
+				double tSplit[PACKET_SIZE];
+				int nearMask = 0, farMask = 0;
+				for (int i = 0; i < PACKET_SIZE; i++) {
+					tSplit[i] = (splitPos - packet.start[axis][i]) * packet.rdir[axis][i];
+					// written so that a NaN (a ray, that lies in the splitting plane: 0 * inf) goes to both
+					// children, with its whole interval (max() and min() below keep tmin/tmax then):
+					nearMask |= !(tSplit[i] < tmin[i]) << i;
+					farMask  |= !(tSplit[i] > tmax[i]) << i;
+				}
+				nearMask &= mask;
+				farMask &= mask;
+				if (farMask) {
+					StackEntry& e = stack[sp++];
+					e.node = farChild;
+					e.mask = farMask;
+					for (int i = 0; i < PACKET_SIZE; i++) {
+						e.tmin[i] = max(tmin[i], tSplit[i]);
+						e.tmax[i] = tmax[i];
+					}
+				}
+				if (nearMask) {
+					for (int i = 0; i < PACKET_SIZE; i++)
+						tmax[i] = min(tmax[i], tSplit[i]);
+					index = nearChild;
+					mask = nearMask;
+					continue;
+				}
+			} else {
+				if (commonOrigin) {
+					found |= intersectLeafCommonOrigin(packet, frays, data, node, mask);
+				} else {
+					for (int i = 0; i < PACKET_SIZE; i++)
+						if ((mask & (1 << i)) && intersectLeaf(packet.rays[i], frays[i], data[i], node))
+							found |= 1 << i;
+				}
+				// (see intersectKD()):
+				for (int i = 0; i < PACKET_SIZE; i++)
+					if ((mask & (1 << i)) && data[i].dist <= tmax[i])
+						alive &= ~(1 << i);
+			}
+		}
+		if (!sp || !alive) break;
+		sp--;
+		index = stack[sp].node;
+		mask = stack[sp].mask & alive;
+		for (int i = 0; i < PACKET_SIZE; i++) {
+			tmin[i] = stack[sp].tmin[i];
+			tmax[i] = stack[sp].tmax[i];
+		}
+	}
+	return found;
+}
+
+bool Mesh::occludedKD(const RRay& ray, double maxDist, double tmin, double tmax)
+{
+	// same traversal as in intersectKD(), but we're happy with whatever hit we find first
+	struct StackEntry {
+		int node;
+		double tmin, tmax;
+	} stack[MAX_TREE_DEPTH + 2];
+	int sp = 0;
+	int index = 0;
+	double gamma, lambda2, lambda3;
+	FloatRay fray(ray, blockOrigin);
+	
+	while (true) {
+		const KDNode& node = kdNodes[index];
+		if (!node.isLeaf()) {
+			Axis axis = node.axis();
+			double splitPos = node.splitPos;
+			double tSplit = (splitPos - ray.start[axis]) * ray.rdir[axis];
+			bool leftFirst = ray.start[axis] < splitPos || (ray.start[axis] == splitPos && ray.dir[axis] <= 0);
+			int nearChild = leftFirst ? index + 1 : node.rightChild();
+			int farChild  = leftFirst ? node.rightChild() : index + 1;
+			if (tSplit > tmax || tSplit <= 0) {
+				index = nearChild;
+			} else if (tSplit < tmin) {
+				index = farChild;
+			} else {
+				stack[sp].node = farChild;
+				stack[sp].tmin = tSplit;
+				stack[sp].tmax = tmax;
+				sp++;
+				index = nearChild;
+				tmax = tSplit;
+			}
 		} else {
-			// if the wall isn't hit, then we intersect exclusively one of the sub-boxes;
-			// test one, if the test fails, then it's in the other:
-			if (firstBB.testIntersect(ray))
-				return intersectKD(firstChild, firstBB, ray, data);
-			else
-				return intersectKD(secondChild, secondBB, ray, data);
+			const int* triList = kdTriangles.data() + node.firstTriangle;
+			const TriangleBlock* blocks = kdBlocks.data() + node.firstTriangle / 4;
+			for (int i = 0, n = node.numTriangles(); i < n; i += 4) {
+				int mask = testTriangleBlock(blocks[i / 4], fray, maxDist);
+				for (int lane = 0; lane < 4 && i + lane < n; lane++)
+					if ((mask & (1 << lane)) && hitTriangle(ray, triangles[triList[i + lane]], maxDist, gamma, lambda2, lambda3))
+						return true;
+			}
+			if (!sp) break;
+			sp--;
+			index = stack[sp].node;
+			tmin = stack[sp].tmin;
+			tmax = stack[sp].tmax;
 		}
 	}
+	return false;
 }
 
-bool Mesh::intersect(const Ray& _ray, IntersectionData& data)
+bool Mesh::occluded(const Ray& _ray, double maxDist)
+{
+	RRay ray(_ray);
+	ray.prepareForTracing();
+	double tmin = 0, tmax = maxDist;
+	if (!boundingBox.clip(ray, tmin, tmax)) return false;
+	
+	// (no backface culling here, as in intersectTriangle() with shadow rays)
+	if (!kdNodes.empty()) return occludedKD(ray, maxDist, tmin, tmax);
+	double gamma, lambda2, lambda3;
+	for (size_t i = 0; i < triangles.size(); i++)
+		if (hitTriangle(ray, triangles[i], maxDist, gamma, lambda2, lambda3))
+			return true;
+	return false;
+}
+
+bool Mesh::intersect(const Ray& ray, IntersectionData& data)
+{
+	if (!findHit(ray, data)) return false;
+	fillSurfaceData(ray, data);
+	return true;
+}
+
+bool Mesh::findHit(const Ray& _ray, IntersectionData& data)
 {
 	RRay ray(_ray);
 	ray.prepareForTracing();
 	bool found = false;
-	// if the ray doesn't intersect the bounding shpere, it is of no use
+	// if the ray doesn't intersect the bounding box, it is of no use
 	// to continue: it can't possibly intersect the mesh.
-	if (!boundingBox.testIntersect(ray)) return false;
+	double tmin = 0, tmax = data.dist;
+	if (!boundingBox.clip(ray, tmin, tmax)) return false;
 	
 	// if we built a KDTree, use that:
-	if (kdroot) {
-		return intersectKD(*kdroot, boundingBox, ray, data);
+	if (!kdNodes.empty()) {
+		found = intersectKD(ray, data, tmin, tmax);
 	} else {
 		// naive algorithm - iterate and check for intersection all triangles:
-		for (size_t i = 0; i < triangles.size(); i++) {
-			if (intersectTriangle(ray, data, triangles[i]))
+		for (int i = 0; i < (int) triangles.size(); i++) {
+			if (intersectTriangle(ray, data, i))
 				found = true;
 		}
-		return found;
 	}
+	if (found) data.g = this;
+	return found;
+}
+
+int Mesh::findHitPacket(const RayPacket& packet, IntersectionData data[], int mask)
+{
+	// the packet traversal needs a KD-tree, and rays that go in the same directions; otherwise, trace them one by one:
+	if (kdNodes.empty() || !packet.sameDirections(mask))
+		return Geometry::findHitPacket(packet, data, mask);
+	double tmin[PACKET_SIZE], tmax[PACKET_SIZE];
+	for (int i = 0; i < PACKET_SIZE; i++) {
+		tmin[i] = 0;
+		tmax[i] = (mask & (1 << i)) ? data[i].dist : 0;
+	}
+	mask = boundingBox.clip(packet, tmin, tmax, mask);
+	if (!mask) return 0;
+	int found = intersectKDPacket(packet, data, tmin, tmax, mask);
+	for (int i = 0; i < PACKET_SIZE; i++)
+		if (found & (1 << i)) data[i].g = this;
+	return found;
 }
 
 // parse a string, convert to double. If string is empty, return 0
@@ -421,38 +1005,138 @@ bool Mesh::loadFromOBJ(const char* filename)
 }
 
 
-void Mesh::build(KDTreeNode& node, const BBox& bbox, const vector<int>& tList, int depth)
+bool Mesh::findSAHSplit(const BBox& bbox, const vector<int>& tList, Axis& bestAxis, double& bestPos)
 {
-	if (tList.size() < MAX_TRIANGLES_PER_LEAF || depth > MAX_TREE_DEPTH) {
-		node.initLeaf(tList);
+	/*
+	 * Binned SAH: for each axis, we consider KD_SAH_BINS - 1 equally spaced candidate planes.
+	 * The cost of splitting at a plane is estimated as
+	 *
+	 *   C = Ctraversal + Cintersect * (nLeft * areaLeft + nRight * areaRight) / area
+	 *
+	 * where nLeft/nRight are the number of triangles, whose bbox (clipped to the node's bbox)
+	 * extends to the left/right of the plane. If no plane beats Cintersect * n (the cost of
+	 * just making a leaf), we don't split.
+	 */
+	const int KD_SAH_BINS = 32;
+	double area = bbox.area();
+	if (area <= 0) return false;
+	// the clipped bboxen of all triangles:
+	vector<BBox> tBoxes(tList.size());
+	for (int i = 0; i < (int) tList.size(); i++) {
+		const Triangle& T = triangles[tList[i]];
+		BBox& tb = tBoxes[i];
+		tb.makeEmpty();
+		for (int j = 0; j < 3; j++) tb.add(vertices[T.v[j]]);
+		for (int dim = 0; dim < 3; dim++) {
+			tb.vmin[dim] = max(tb.vmin[dim], bbox.vmin[dim]);
+			tb.vmax[dim] = min(tb.vmax[dim], bbox.vmax[dim]);
+		}
+	}
+	double bestCost = sahIntersectCost * tList.size();
+	bool found = false;
+	for (int axis = AXIS_X; axis <= AXIS_Z; axis++) {
+		double axisL = bbox.vmin[axis];
+		double axisR = bbox.vmax[axis];
+		double width = axisR - axisL;
+		if (width <= 1e-9) continue;
+		int minCount[KD_SAH_BINS] = { 0 };
+		int maxCount[KD_SAH_BINS] = { 0 };
+		double scale = KD_SAH_BINS / width;
+		for (int i = 0; i < (int) tBoxes.size(); i++) {
+			int lo = (int) ((tBoxes[i].vmin[axis] - axisL) * scale);
+			int hi = (int) ((tBoxes[i].vmax[axis] - axisL) * scale);
+			minCount[max(0, min(KD_SAH_BINS - 1, lo))]++;
+			maxCount[max(0, min(KD_SAH_BINS - 1, hi))]++;
+		}
+		// nLeft(k): triangles starting before plane k; nRight(k): triangles ending after plane k:
+		int nRight[KD_SAH_BINS];
+		nRight[KD_SAH_BINS - 1] = maxCount[KD_SAH_BINS - 1];
+		for (int k = KD_SAH_BINS - 2; k >= 0; k--)
+			nRight[k] = nRight[k + 1] + maxCount[k];
+		int nLeft = 0;
+		for (int k = 1; k < KD_SAH_BINS; k++) {
+			nLeft += minCount[k - 1];
+			// the flattened tree stores the split position as a float; evaluate the plane that is
+			// actually going to be used when tracing:
+			double splitPos = (float) (axisL + k * width / KD_SAH_BINS);
+			if (splitPos <= axisL || splitPos >= axisR) continue; // rounded outside the node
+			BBox bbLeft, bbRight;
+			bbox.split((Axis) axis, splitPos, bbLeft, bbRight);
+			double cost = sahTraversalCost +
+				sahIntersectCost * (nLeft * bbLeft.area() + nRight[k] * bbRight.area()) / area;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = (Axis) axis;
+				bestPos = splitPos;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+void Mesh::build(KDTreeNode& node, const BBox& bbox, const vector<int>& tList, int depth, KDBuildTask* task)
+{
+	Axis axis;
+	double splitPos;
+	if (useSAH) {
+		if (depth > MAX_TREE_DEPTH || !findSAHSplit(bbox, tList, axis, splitPos)) {
+			node.initLeaf(tList);
+			return;
+		}
 	} else {
-		Axis axis = (Axis) (depth % 3); // alternate splitting planes: X, Y, Z, X, Y, Z, ...
+		if (tList.size() < MAX_TRIANGLES_PER_LEAF || depth > MAX_TREE_DEPTH) {
+			node.initLeaf(tList);
+			return;
+		}
+		axis = (Axis) (depth % 3); // alternate splitting planes: X, Y, Z, X, Y, Z, ...
 		double axisL = bbox.vmin[axis]; // the left and right extents of the bbox along the chosen axis
 		double axisR = bbox.vmax[axis];
 		
 		// naive split-position choice here: just use the middle of the current bbox.
-		// A smarter algo could be used here:
-		double splitPos = (axisL + axisR) * 0.5;
-		BBox bbLeft, bbRight;
-		bbox.split(axis, splitPos, bbLeft, bbRight);
-		
-		// Split the triangle list into tLeft, tRight, depending on which BBox the triangles
-		// intersect with.
-		vector<int> tLeft, tRight;
-		for (int i = 0; i < (int) tList.size(); i++) {
-			Triangle& T = triangles[tList[i]];
-			const Vector& A = vertices[T.v[0]];
-			const Vector& B = vertices[T.v[1]];
-			const Vector& C = vertices[T.v[2]];
-			// usually, a triangle will go either in the left or the right list. In some
-			// cases, it may go in both (which is bad, but we hope this would be rare):
-			if (bbLeft.intersectTriangle(A, B, C))
-				tLeft.push_back(tList[i]);
-			if (bbRight.intersectTriangle(A, B, C))
-				tRight.push_back(tList[i]);
+		// It is rounded to a float, as stored in the flattened tree:
+		splitPos = (float) ((axisL + axisR) * 0.5);
+		if (splitPos <= axisL || splitPos >= axisR) { // the node is too thin to be split in floats
+			node.initLeaf(tList);
+			return;
 		}
-		node.initBinary(axis, splitPos);
-		build(node.children[0], bbLeft, tLeft, depth + 1);
-		build(node.children[1], bbRight, tRight, depth + 1);
 	}
+	// splitPos is already rounded to a float here, so the child bboxen and the triangle lists below
+	// match the plane that is used when tracing the flattened tree:
+	BBox bbLeft, bbRight;
+	bbox.split(axis, splitPos, bbLeft, bbRight);
+	
+	// Split the triangle list into tLeft, tRight, depending on which BBox the triangles
+	// intersect with.
+	vector<int> tLeft, tRight;
+	for (int i = 0; i < (int) tList.size(); i++) {
+		Triangle& T = triangles[tList[i]];
+		const Vector& A = vertices[T.v[0]];
+		const Vector& B = vertices[T.v[1]];
+		const Vector& C = vertices[T.v[2]];
+		// usually, a triangle will go either in the left or the right list. In some
+		// cases, it may go in both (which is bad, but we hope this would be rare):
+		if (bbLeft.intersectTriangle(A, B, C))
+			tLeft.push_back(tList[i]);
+		if (bbRight.intersectTriangle(A, B, C))
+			tRight.push_back(tList[i]);
+	}
+	// the binned SAH works with approximate triangle counts; verify the split still pays off with the
+	// exact ones (e.g., triangles sharing a vertex would otherwise get split ad infinitum):
+	if (useSAH && sahTraversalCost + sahIntersectCost *
+			(tLeft.size() * bbLeft.area() + tRight.size() * bbRight.area()) / bbox.area()
+			>= sahIntersectCost * tList.size()) {
+		node.initLeaf(tList);
+		return;
+	}
+	node.initBinary(axis, splitPos);
+	// when building in parallel, leave the large subtrees to the other threads:
+	if (task && (int) tLeft.size() >= KD_PARALLEL_BUILD_THRESHOLD)
+		task->addJob(&node.children[0], bbLeft, tLeft, depth + 1);
+	else
+		build(node.children[0], bbLeft, tLeft, depth + 1, task);
+	if (task && (int) tRight.size() >= KD_PARALLEL_BUILD_THRESHOLD)
+		task->addJob(&node.children[1], bbRight, tRight, depth + 1);
+	else
+		build(node.children[1], bbRight, tRight, depth + 1, task);
 }
@@ -25,7 +25,7 @@
 #include "geometry.h"
 #include "bbox.h"
 
-// A node of the K-d tree. It is either a in-node (if axis is AXIS_X, AXIS_Y, AXIS_Z),
+// A node of the K-d tree, as created by Mesh::build(). It is either a in-node (if axis is AXIS_X, AXIS_Y, AXIS_Z),
 // in which case the 'splitPos' holds the split position, and data.children is an array
 // of two children.
 // If axis is AXIS_NONE, then it is a leaf node, and data.triangles holds a list of
@@ -63,6 +63,51 @@ struct KDTreeNode {
 	}
 };
 
+// A compact (8 bytes) node of the "flattened" K-d tree, which is what is actually used for tracing.
+// All nodes of a tree live in a single array. The left child of an in-node immediately follows it
+// in the array, while the index of the right child is stored in the node itself. The triangle lists
+// of all leaves are stored in a single shared array of triangle indices.
+//
+// The lowest two bits of `bits' hold the axis (AXIS_X, AXIS_Y, AXIS_Z or AXIS_NONE for leaves); the
+// remaining 30 bits hold the index of the right child (in-nodes) or the triangle count (leaves).
+struct KDNode {
+	union {
+		float splitPos;    //!< in-nodes: the position of the splitting plane
+		int firstTriangle; //!< leaves: the index of the first triangle index in the shared list
+	};
+	unsigned bits;
+	
+	inline Axis axis() const { return (Axis) (bits & 3); }
+	inline bool isLeaf() const { return (bits & 3) == AXIS_NONE; }
+	inline int rightChild() const { return bits >> 2; }
+	inline int numTriangles() const { return bits >> 2; }
+	
+	void initLeaf(int firstTriangle, int numTriangles)
+	{
+		this->firstTriangle = firstTriangle;
+		bits = AXIS_NONE | (numTriangles << 2);
+	}
+	void initBinary(Axis axis, float splitPos)
+	{
+		this->splitPos = splitPos;
+		bits = axis; // the right child is filled in later (see setRightChild)
+	}
+	void setRightChild(int index) { bits = (bits & 3) | (index << 2); }
+};
+
+/// Four triangles, packed in a "structure of arrays" manner, so that a ray can be tested against all of them
+/// at once, using SIMD instructions (see testTriangleBlock() in mesh.cpp). Single precision is enough here,
+/// as this is only used to filter out the triangles, that are certainly missed. The vertices are stored relative
+/// to Mesh::blockOrigin, so that the floats keep their precision, even if the mesh is far from the world origin.
+struct TriangleBlock {
+	float ax[4], ay[4], az[4];    //!< vertex A (relative to Mesh::blockOrigin)
+	float abx[4], aby[4], abz[4]; //!< edge AB
+	float acx[4], acy[4], acz[4]; //!< edge AC
+};
+
+class KDBuildTask;
+struct FloatRay;
+
 class Mesh: public Geometry {
 	std::vector<Vector> vertices; //!< An array with all vertices in the mesh
 	std::vector<Vector> normals; //!< An array with all normals in the mesh
@@ -70,8 +115,15 @@ class Mesh: public Geometry {
 	std::vector<Triangle> triangles; //!< An array that holds all triangles
 	
 	// intersect a ray with a single triangle. Return true if an intersection exists, and it's
-	// closer to the minimum distance, stored in data.dist
-	bool intersectTriangle(const RRay& ray, IntersectionData& data, Triangle& T);
+	// closer to the minimum distance, stored in data.dist. Only the hit record is stored in data (see findHit())
+	inline bool intersectTriangle(const RRay& ray, IntersectionData& data, int triIdx);
+	// intersect a ray with all triangles in a leaf of the KD-tree (`fray' is the same ray, in single precision)
+	inline bool intersectLeaf(const RRay& ray, const FloatRay& fray, IntersectionData& data, const KDNode& node);
+	inline int intersectLeafCommonOrigin(const RayPacket& packet, const FloatRay frays[], IntersectionData data[],
+	                                     const KDNode& node, int mask);
+	// the bare ray-triangle test: checks for a hit closer than maxDist, and returns its distance and barycentric coords
+	inline bool hitTriangle(const RRay& ray, const Triangle& T, double maxDist,
+	                        double& gamma, double& lambda2, double& lambda3) const;
 	void initMesh(void);
 	
 	bool faceted; //!< whether the normals interpolation is disabled or not
@@ -82,16 +134,42 @@ class Mesh: public Geometry {
 	
 	bool loadFromOBJ(const char* filename); //!< load a mesh from an .OBJ file.
 	bool useKDTree; //!< whether to use a KD-tree to speed-up intersections
-	KDTreeNode* kdroot; //!< a pointer to the root of the KDTree. Can be NULL if no tree is built.
+	bool useSAH; //!< whether to use the Surface Area Heuristic when building the KD-tree (otherwise, split in the middle)
+	double sahTraversalCost; //!< SAH: the estimated cost of traversing a single KD-tree in-node
+	double sahIntersectCost; //!< SAH: the estimated cost of a single ray-triangle intersection test
+	std::vector<KDNode> kdNodes; //!< the flattened KD-tree (kdNodes[0] is the root). Empty if no tree is built.
+	std::vector<int> kdTriangles; //!< triangle indices, referred to by the leaves of the flattened tree. Each leaf's list starts at a multiple of 4
+	std::vector<TriangleBlock> kdBlocks; //!< the triangles from kdTriangles, packed in fours (kdBlocks[i] holds kdTriangles[4*i .. 4*i+3])
+	Vector blockOrigin; //!< the center of the bounding box; kdBlocks' vertices (and the FloatRay origins) are relative to it
 	
-	void build(KDTreeNode& node, const BBox& bbox, const std::vector<int>& triangles, int depth);
-	bool intersectKD(KDTreeNode& node, const BBox& bbox, const RRay& ray, IntersectionData& data);
+	// build the given node from a list of triangles. If task isn't NULL, the large subtrees are queued there
+	// (to be built by other threads), instead of being built right away.
+	void build(KDTreeNode& node, const BBox& bbox, const std::vector<int>& triangles, int depth, KDBuildTask* task);
+	void flatten(const KDTreeNode& node); //!< appends the given subtree to kdNodes/kdTriangles
+	void packTriangles(void); //!< creates kdBlocks from kdTriangles
+	// find the best split plane for the given node, according to the SAH. Returns false if it's best not to split at all
+	bool findSAHSplit(const BBox& bbox, const std::vector<int>& triangles, Axis& axis, double& splitPos);
+	// trace a ray through the KD-tree; [tmin, tmax] is the part of the ray that's inside the mesh's bbox
+	bool intersectKD(const RRay& ray, IntersectionData& data, double tmin, double tmax);
+	bool occludedKD(const RRay& ray, double maxDist, double tmin, double tmax); //!< any-hit version of intersectKD()
+	// trace a packet of rays through the KD-tree together. All rays in `mask' must go in the same directions
+	// (see RayPacket::sameDirections()). Returns the mask of the rays, for which a closer hit was found
+	int intersectKDPacket(const RayPacket& packet, IntersectionData data[], double tmin[], double tmax[], int mask);
+	friend class KDBuildTask;
 public:
-	Mesh() { faceted = false; backfaceCulling = true; useKDTree = true; autoSmooth = true; }
-	~Mesh();
+	Mesh() {
+		faceted = false; backfaceCulling = true; useKDTree = true; autoSmooth = true;
+		useSAH = true; sahTraversalCost = 1.0; sahIntersectCost = 1.5;
+	}
 	const char* getName();
 	bool intersect(const Ray& ray, IntersectionData& info);
+	bool findHit(const Ray& ray, IntersectionData& info);
+	int findHitPacket(const RayPacket& packet, IntersectionData data[], int mask);
+	void fillSurfaceData(const Ray& ray, IntersectionData& info);
+	bool occluded(const Ray& ray, double maxDist);
 	bool isInside(const Vector& p) const { return false; } //FIXME!!
+	bool getBBox(BBox& box) const { box = boundingBox; return true; }
+	void beginRender(); //!< builds the KD-tree
 	
 	void setFaceted(bool faceted) { this->faceted = faceted; }
 	
@@ -105,6 +183,9 @@ public:
 		pb.getBoolProp("faceted", &faceted);
 		pb.getBoolProp("backfaceCulling", &backfaceCulling);
 		pb.getBoolProp("useKDTree", &useKDTree);
+		pb.getBoolProp("useSAH", &useSAH);
+		pb.getDoubleProp("sahTraversalCost", &sahTraversalCost, 0);
+		pb.getDoubleProp("sahIntersectCost", &sahIntersectCost, 1e-6);
 		pb.getBoolProp("autoSmooth", &autoSmooth);
 		initMesh();
 	}
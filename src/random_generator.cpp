@@ -19,9 +19,11 @@
  ***************************************************************************/
  
 #include <math.h>
-#include <SDL/SDL.h>
 #include "random_generator.h"
 #include "constants.h"
+#include "cxxptl_sdl.h"
+
+static unsigned sampleSeed = 0; //!< the base seed for seedSample(), from initRandom()
 
 Random::Random(unsigned seed)
 {
@@ -30,37 +32,64 @@ Random::Random(unsigned seed)
 
 void Random::seed(unsigned s)
 {
+#ifdef TRINITY_RANDOM_MT
 	generator.seed(s);
+#else
+	counter = s;
+#endif
 }
 
-unsigned Random::_next(void)
+void Random::seedSample(unsigned x, unsigned y, unsigned sample)
 {
-	std::uniform_int_distribution<unsigned> gen;
-	return gen(generator);
+#ifndef TRINITY_RANDOM_MT
+	// mix the coordinates well, so that the neighbouring pixels/samples get unrelated streams:
+	unsigned long long key = (((unsigned long long) x << 32) | y) ^ ((unsigned long long) sample * 0xd6e8feb86659fd93ULL);
+	key ^= (unsigned long long) sampleSeed << 16;
+	key = (key ^ (key >> 32)) * 0xd6e8feb86659fd93ULL;
+	key = (key ^ (key >> 32)) * 0xd6e8feb86659fd93ULL;
+	counter = key ^ (key >> 32);
+#endif
 }
 
 int Random::randint(int a, int b)
 {
-	std::uniform_int_distribution<int> gen(a, b);
-	return gen(generator);
+	// scale a 32-bit number to the range by a multiply-shift (the bias is at most range/2^32)
+	unsigned range = (unsigned) (b - a) + 1u;
+	if (range == 0) return (int) _next(); // the whole 32-bit range
+	return a + (int) (((unsigned long long) _next() * range) >> 32);
 }
 
 float Random::randfloat(void)
 {
-	std::uniform_real_distribution<float> gen;
-	return gen(generator);
+	return (_next() >> 8) * (1.0f / 16777216.0f); // 24 bits of mantissa
 }
 
 double Random::randdouble(void)
 {
-	std::uniform_real_distribution<double> gen;
-	return gen(generator);
+	unsigned long long hi = _next() >> 5;
+	unsigned long long lo = _next() >> 6;
+	return (hi * 67108864 + lo) * (1.0 / 9007199254740992.0); // 53 bits of mantissa
 }
 
 double Random::gaussian(double mean, double sigma)
 {
-	std::normal_distribution<double> gen(mean, sigma);
-	return gen(generator);
+	// Box-Muller transform:
+	double u = 1.0 - randdouble(); // in (0..1], so that log() is finite
+	double v = randdouble();
+	return mean + sigma * sqrt(-2.0 * log(u)) * cos(2 * PI * v);
+}
+
+void Random::fill(float* out, int count)
+{
+#ifdef TRINITY_RANDOM_MT
+	for (int i = 0; i < count; i++)
+		out[i] = randfloat();
+#else
+	const unsigned long long base = counter;
+	for (int i = 0; i < count; i++)
+		out[i] = (hash(base + (unsigned long long) (i + 1) * 0x9e3779b97f4a7c15ULL) >> 8) * (1.0f / 16777216.0f);
+	counter = base + (unsigned long long) count * 0x9e3779b97f4a7c15ULL;
+#endif
 }
 
 void Random::unitDiscSample(double &x, double &y)
@@ -87,6 +116,7 @@ void initRandom(unsigned seed)
 {
 	for (int i = 0; i < RGENS; i++)
 		rg_table[i].key = 0xffffffff;
+	sampleSeed = seed;
 	const int MAXWARM = 1223;
 	seed ^= 0xbf14ef80; // just in case the user passes '0'...
 	// initialize and warm-up the zeroth random generator:
@@ -120,9 +150,18 @@ Random& getRandomGen(int idx)
 	return rg_table[i].r;
 }
 
-Random& getRandomGen()
+thread_local Random* threadRandomGen = NULL;
+static volatile int threadsWithGens = 0;
+
+Random* newThreadRandomGen(void)
 {
-	return getRandomGen(SDL_ThreadID());
+	// each thread gets its own seed, derived from the initRandom() seed and the thread's ordinal:
+	unsigned n = atomic_add(&threadsWithGens, 1);
+	unsigned seed = (sampleSeed ^ 0xbf14ef80) + n * 0x9e3779b9u;
+	seed = (seed ^ (seed >> 16)) * 0x85ebca6bu;
+	seed = (seed ^ (seed >> 13)) * 0xc2b2ae35u;
+	threadRandomGen = new Random(seed ^ (seed >> 16));
+	return threadRandomGen;
 }
 
 // random generator testing code below (disabled)
@@ -136,7 +175,7 @@ Random& getRandomGen()
 #include "color.h"
 #include "sdl.h"
 
-extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE];
+extern FrameBuffer vfb;
 
 static Random* grand;
 
@@ -26,24 +26,55 @@
  * @File random_generator.h
  * @Brief holds the Random class, and some functions to fetch random number generators
  *
- * The Random class is based on the high-quality mt19937 (Mersenne Twister)
- * pseudo-random number generator, using the C++11 implementation
+ * By default, the Random class is a counter-based generator: the n-th number is a strong hash
+ * (the SplitMix64 finalizer) of seed + n * golden ratio. This makes it tiny (8 bytes of state), very
+ * cheap to reseed (see seedSample()), and fill() can compute many numbers at once, independently.
+ *
+ * Building with TRINITY_RANDOM_MT selects the previous generator instead: the high-quality mt19937
+ * (Mersenne Twister), using the C++11 implementation. It's slower and has 2.5 KB of state, which
+ * makes reseeding too expensive, so seedSample() does nothing in that case.
  *
  * The Random class is not intended to be created and used directly.
- * Its construction is costly; instead, use one of the getRandomGen() functions.
+ * Instead, use one of the getRandomGen() functions.
  */
  
  class Random {
+#ifdef TRINITY_RANDOM_MT
 	std::mt19937 generator; // mersenne twister generator
+#else
+	unsigned long long counter; // the seed, plus the count of numbers generated so far, times the golden ratio
+	static inline unsigned hash(unsigned long long z)
+	{
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return (unsigned) ((z ^ (z >> 31)) >> 32);
+	}
+#endif
 public:
 	Random(unsigned seed = 123u);
 	void seed(unsigned seed);
-	unsigned _next(void); // returns a raw 32-bit unbiased random integer
+	/// reseeds the generator for the given sample of a pixel (x, y). This way, the random numbers that a sample
+	/// uses don't depend on which thread renders it, or in what order (as long as the entire sample is rendered
+	/// on the same thread). The result depends on the initRandom() seed as well. No-op with TRINITY_RANDOM_MT.
+	void seedSample(unsigned x, unsigned y, unsigned sample);
+	
+	// returns a raw 32-bit unbiased random integer
+	inline unsigned _next(void)
+	{
+#ifdef TRINITY_RANDOM_MT
+		return generator();
+#else
+		return hash(counter += 0x9e3779b97f4a7c15ULL);
+#endif
+	}
 	int randint(int a, int b); // returns a random integer in [a..b] (a and b can be negative as well)
 	float randfloat(void); // return a floating-point number in [0..1)
 	double randdouble(void); // same as randfloat(), but in double precision (using two _next() invocations)
 	double gaussian(double mean = 0.0, double sigma = 1.0); // return a random number in normal distribution
 	void unitDiscSample(double& x, double &y); // get a random point in the unit disc (x*x + y*y <= 1)
+	/// fills `out' with `count' floating-point numbers in [0..1). The same as calling randfloat() `count' times,
+	/// but (with the default generator) the loop has no dependencies between iterations, so it is vectorizable.
+	void fill(float* out, int count);
 };
  
 /// seed the whole array of random generators.
@@ -53,9 +84,18 @@ void initRandom(unsigned seed);
 /// This function does not take any start-up time and should be very fast.
 Random& getRandomGen(int idx);
 
-/// fetch a fixed random generator, based on the calling thread's ID. I.e., within each thread, all calls to getRandomGen()
+extern thread_local Random* threadRandomGen; //!< the calling thread's generator (NULL until its first getRandomGen())
+Random* newThreadRandomGen(void); //!< creates (and sets) the generator of the calling thread. Don't call directly
+
+/// fetch the random generator of the calling thread. I.e., within each thread, all calls to getRandomGen()
 /// are guaranteed to return the same object; in the same time, different threads get different random generators
-/// thus no locking is required, and no performance degradation can occur.
-Random& getRandomGen(void);
+/// thus no locking is required. After the first call in a thread, this is just a read of a thread-local pointer.
+/// The generators are never freed, so threads shouldn't be created (and killed) by the thousands.
+inline Random& getRandomGen(void)
+{
+	Random* gen = threadRandomGen;
+	if (!gen) gen = newThreadRandomGen();
+	return *gen;
+}
 
 #endif // __RANDOM_GENERATOR_H__
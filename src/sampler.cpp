@@ -0,0 +1,267 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <math.h>
+#include "sampler.h"
+#include "random_generator.h"
+#include "constants.h"
+
+static SamplerType samplerType = SAMPLER_RANDOM;
+static unsigned samplerSeed = 0;
+
+// a 32-bit integer hash (the "lowbias32" finalizer), used to derive the per-pixel randomization
+static inline unsigned hash(unsigned x)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static inline unsigned hashCombine(unsigned seed, unsigned v)
+{
+	return hash(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+// converts a 32-bit fixed point number in [0..1) to a float in [0..1). Only the top 24 bits are used, so that
+// the result is never rounded up to 1.0
+static inline float toFloat(unsigned x)
+{
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+void Sampler::beginSample(unsigned x, unsigned y, unsigned sampleIndex)
+{
+	getRandomGen().seedSample(x, y, sampleIndex);
+	pixelKey = hashCombine(hashCombine(samplerSeed, x), y);
+	index = sampleIndex;
+	dimension = SAMPLER_PIXEL;
+	bounce = SAMPLER_FIRST_BOUNCE;
+}
+
+void Sampler::unitDiscSample(double& x, double& y)
+{
+	float u, v;
+	get2D(u, v);
+	concentricDiscSample(u, v, x, y);
+}
+
+void concentricDiscSample(float u, float v, double& x, double& y)
+{
+	double a = 2 * u - 1, b = 2 * v - 1;
+	if (a == 0 && b == 0) {
+		x = y = 0;
+		return;
+	}
+	double r, phi;
+	if (fabs(a) > fabs(b)) {
+		r = a;
+		phi = (PI / 4) * (b / a);
+	} else {
+		r = b;
+		phi = PI / 2 - (PI / 4) * (a / b);
+	}
+	x = r * cos(phi);
+	y = r * sin(phi);
+}
+
+/// white noise; just takes the numbers from the thread's Random
+class RandomSampler: public Sampler {
+protected:
+	float sample(unsigned dim)
+	{
+		return getRandomGen().randfloat();
+	}
+};
+
+/// the Halton sequence: dimension `d' is the radical inverse of the sample index in base primes[d]. It is
+/// randomized by Owen scrambling: each digit is permuted randomly, depending on the pixel, the dimension and
+/// the previous digits. Without that, the dimensions with larger bases are strongly correlated (e.g., the first
+/// 17 samples in bases 17 and 19 lie on a line). Beyond the last prime in the table, this falls back to
+/// random numbers.
+class HaltonSampler: public Sampler {
+	enum { NUM_PRIMES = 32 };
+	static const unsigned primes[NUM_PRIMES];
+	// a random permutation of 0..l-1, given by the seed `p' (Kensler, "Correlated Multi-Jittered Sampling", 2013)
+	static unsigned permute(unsigned i, unsigned l, unsigned p)
+	{
+		unsigned w = l - 1;
+		w |= w >> 1;
+		w |= w >> 2;
+		w |= w >> 4;
+		w |= w >> 8;
+		w |= w >> 16;
+		do {
+			i ^= p; i *= 0xe170893du;
+			i ^= p >> 16;
+			i ^= (i & w) >> 4;
+			i ^= p >> 8; i *= 0x0929eb3fu;
+			i ^= p >> 23;
+			i ^= (i & w) >> 1; i *= 1 | p >> 27;
+			i *= 0x6935fa69u;
+			i ^= (i & w) >> 11; i *= 0x74dcb303u;
+			i ^= (i & w) >> 2; i *= 0x9e501cc3u;
+			i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+			i &= w;
+			i ^= i >> 5;
+		} while (i >= l);
+		return (i + p) % l;
+	}
+protected:
+	float sample(unsigned dim)
+	{
+		if (dim >= NUM_PRIMES) return getRandomGen().randfloat();
+		unsigned base = primes[dim];
+		unsigned seed = hashCombine(pixelKey, dim);
+		double invBase = 1.0 / base, f = 1, r = 0;
+		for (unsigned n = index; n; n /= base) {
+			f *= invBase;
+			unsigned digit = permute(n % base, base, seed);
+			r += digit * f;
+			seed = hashCombine(seed, digit);
+		}
+		// the scrambled trailing zero digits are just a uniformly distributed random number:
+		r += f * (hash(seed) * (1.0 / 4294967296.0));
+		float result = float(r);
+		return result < 1 ? result : 0.99999994f; // could be rounded up to 1.0
+	}
+};
+
+const unsigned HaltonSampler::primes[NUM_PRIMES] = {
+	  2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+	 59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+};
+
+/**
+ * The Sobol sequence, randomized by hash-based Owen scrambling (Burley, "Practical Hash-based Owen Scrambling",
+ * JCGT 2020). Only the first four Sobol dimensions are used; they're good in every pair. The dimensions of a
+ * sample are split into sets of four (which the SAMPLER_* layout is aligned to), and each set gets the
+ * four-dimensional sequence with a differently shuffled index and differently scrambled points.
+ */
+class SobolSampler: public Sampler {
+	enum { SOBOL_DIMS = 4 };
+	/// the generator matrices, one column (direction number) per bit of the index. They're precomputed for
+	/// each byte of the index, i.e. table[k][b][d] is the xor of the columns of the k-th byte's bits, set in b
+	static unsigned table[4][256][SOBOL_DIMS];
+	// the last computed set of four dimensions (the sampling code mostly uses the dimensions in order):
+	unsigned cachedKey, cachedIndex, cachedSet;
+	unsigned cachedSeed, cachedPoint[SOBOL_DIMS];
+	static inline unsigned reverseBits(unsigned x)
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+		return (x >> 16) | (x << 16);
+	}
+	// a random permutation, where each bit only depends on the lower bits (Laine & Karras, 2011)
+	static inline unsigned laineKarrasPermutation(unsigned x, unsigned seed)
+	{
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+	// Owen scrambling: each bit is flipped, depending on the higher bits
+	static inline unsigned owenScramble(unsigned x, unsigned seed)
+	{
+		return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+	}
+protected:
+	float sample(unsigned dim)
+	{
+		unsigned set = dim / SOBOL_DIMS, d = dim % SOBOL_DIMS;
+		if (set != cachedSet || index != cachedIndex || pixelKey != cachedKey) {
+			cachedKey = pixelKey;
+			cachedIndex = index;
+			cachedSet = set;
+			cachedSeed = hashCombine(pixelKey, set);
+			unsigned n = owenScramble(index, cachedSeed);
+			for (int i = 0; i < SOBOL_DIMS; i++)
+				cachedPoint[i] = 0;
+			for (int k = 0; k < 4; k++, n >>= 8)
+				for (int i = 0; i < SOBOL_DIMS; i++)
+					cachedPoint[i] ^= table[k][n & 0xff][i];
+		}
+		return toFloat(owenScramble(cachedPoint[d], hashCombine(cachedSeed, d)));
+	}
+public:
+	SobolSampler(): cachedKey(0), cachedIndex(0), cachedSet(~0u), cachedSeed(0) {}
+	static void init(void);
+};
+
+unsigned SobolSampler::table[4][256][SOBOL_DIMS];
+
+void SobolSampler::init(void)
+{
+	// the primitive polynomials and the initial direction numbers of dimensions 2..4 (Joe & Kuo, 2008):
+	static const struct { int s, a; unsigned m[3]; } params[SOBOL_DIMS - 1] = {
+		{ 1, 0, { 1 } },
+		{ 2, 1, { 1, 3 } },
+		{ 3, 1, { 1, 3, 1 } },
+	};
+	unsigned matrix[SOBOL_DIMS][32];
+	for (int i = 0; i < 32; i++)
+		matrix[0][i] = 1u << (31 - i); // the first dimension is the van der Corput sequence
+	for (int d = 1; d < SOBOL_DIMS; d++) {
+		int s = params[d - 1].s, a = params[d - 1].a;
+		unsigned* v = matrix[d];
+		for (int i = 0; i < s; i++)
+			v[i] = params[d - 1].m[i] << (31 - i);
+		for (int i = s; i < 32; i++) {
+			v[i] = v[i - s] ^ (v[i - s] >> s);
+			for (int k = 1; k < s; k++)
+				if ((a >> (s - 1 - k)) & 1)
+					v[i] ^= v[i - k];
+		}
+	}
+	for (int k = 0; k < 4; k++)
+		for (int b = 0; b < 256; b++)
+			for (int d = 0; d < SOBOL_DIMS; d++) {
+				unsigned x = 0;
+				for (int bit = 0; bit < 8; bit++)
+					if (b & (1 << bit)) x ^= matrix[d][k * 8 + bit];
+				table[k][b][d] = x;
+			}
+}
+
+void initSamplers(SamplerType type, unsigned seed)
+{
+	samplerType = type;
+	samplerSeed = hash(seed ^ 0x5bd1e995u);
+	if (type == SAMPLER_SOBOL)
+		SobolSampler::init();
+}
+
+thread_local Sampler* threadSampler = NULL;
+
+Sampler* newThreadSampler(void)
+{
+	switch (samplerType) {
+		case SAMPLER_HALTON: threadSampler = new HaltonSampler; break;
+		case SAMPLER_SOBOL: threadSampler = new SobolSampler; break;
+		default: threadSampler = new RandomSampler; break;
+	}
+	return threadSampler;
+}
@@ -0,0 +1,131 @@
+/***************************************************************************
+ *   Copyright (C) 2009-2013 by Veselin Georgiev, Slavomir Kaslev et al    *
+ *   admin@raytracing-bg.net                                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+/**
+ * @File sampler.h
+ * @Brief the Sampler class, which supplies the sample points for the Monte-Carlo estimators
+ *
+ * A sample (a DOF ray, or a GI path) needs a number of random values in [0..1): the position within
+ * the pixel, the position on the lens, and then a few per bounce (which light, where on the light, in which
+ * direction to continue). Each of these is a "dimension" of the sample. Instead of using white noise for all
+ * of them, a Sampler can produce the i-th point of a low-discrepancy sequence, so that the samples of a pixel
+ * cover each dimension (and each pair of dimensions, like the pixel area) much more evenly. For that to work,
+ * every value must come from the same dimension in every sample; that's why the dimensions are laid out
+ * in a fixed way (see the SAMPLER_* constants below).
+ *
+ * Like the Random class, a Sampler is not intended to be created directly. Use getSampler() instead.
+ */
+
+/// the sample point generators, as selected by GlobalSettings::sampler
+enum SamplerType {
+	SAMPLER_RANDOM, //!< independent random numbers (white noise)
+	SAMPLER_HALTON, //!< the Halton sequence, randomized per pixel by Owen scrambling (random digit permutations)
+	SAMPLER_SOBOL,  //!< the Sobol sequence, randomized per pixel by hash-based Owen scrambling
+};
+
+/// the layout of the dimensions of a sample:
+enum {
+	SAMPLER_PIXEL = 0,          //!< 2D: the position within the pixel
+	SAMPLER_LENS = 2,           //!< 2D: the position on the lens (DOF)
+	SAMPLER_FIRST_BOUNCE = 4,   //!< the dimensions of the first bounce of a path start here
+	SAMPLER_BOUNCE_DIMS = 8,    //!< the dimensions used per bounce. Within a bounce, these are:
+	SAMPLER_LIGHT_CHOICE = 0,   //!< 1D: which light to sample
+	SAMPLER_LIGHT_SAMPLE = 1,   //!< 1D: which of the light's samples to use
+	SAMPLER_LIGHT_POS = 2,      //!< 2D: the position on the light
+	SAMPLER_BRDF = 4,           //!< 2D: the direction, chosen by the BRDF
+	SAMPLER_BRDF_LOBE = 6,      //!< 1D: which lobe of the BRDF to sample (if it has several)
+};
+
+class Sampler {
+protected:
+	unsigned pixelKey;  //!< a hash of the pixel, which randomizes the sequence differently for each pixel
+	unsigned index;     //!< the index of the current sample within the pixel
+	unsigned dimension; //!< the next dimension to be used
+	unsigned bounce;    //!< the first dimension of the current bounce
+
+	/// returns the coordinate of the `index'-th sample of the pixel in the given dimension, in [0..1)
+	virtual float sample(unsigned dim) = 0;
+public:
+	Sampler(): pixelKey(0), index(0), dimension(0), bounce(SAMPLER_FIRST_BOUNCE) {}
+	virtual ~Sampler() {}
+
+	/// starts the given sample of a pixel (x, y). It also reseeds the calling thread's Random
+	/// (see Random::seedSample()), so that the code, which still uses random numbers directly,
+	/// stays reproducible as well.
+	void beginSample(unsigned x, unsigned y, unsigned sampleIndex);
+
+	/// starts the given bounce of a path (0 is the first hit, i.e. Ray::depth of the camera ray)
+	inline void beginBounce(int depth)
+	{
+		bounce = dimension = SAMPLER_FIRST_BOUNCE + depth * SAMPLER_BOUNCE_DIMS;
+	}
+
+	/// skips to a particular dimension within the current bounce (SAMPLER_LIGHT_POS, etc.)
+	inline void setBounceDimension(int offset)
+	{
+		dimension = bounce + offset;
+	}
+
+	/// skips to a particular dimension of the sample (SAMPLER_PIXEL or SAMPLER_LENS)
+	inline void setDimension(int dim)
+	{
+		dimension = dim;
+	}
+
+	/// returns the value of the next dimension, in [0..1)
+	inline float get1D(void)
+	{
+		return sample(dimension++);
+	}
+
+	/// returns the values of the next two dimensions, in [0..1)
+	inline void get2D(float& u, float& v)
+	{
+		u = sample(dimension++);
+		v = sample(dimension++);
+	}
+
+	/// returns a point in the unit disc (x*x + y*y <= 1), using the next two dimensions
+	void unitDiscSample(double& x, double& y);
+};
+
+/// maps a point (u, v) in the unit square to the unit disc (x*x + y*y <= 1), uniformly. It uses the "concentric"
+/// mapping (Shirley & Chiu, 1997); unlike the polar one, it keeps the neighbouring points close together,
+/// so a well-spaced set of points remains well-spaced
+void concentricDiscSample(float u, float v, double& x, double& y);
+
+/// sets the type of the samplers, and the seed for their per-pixel randomization.
+/// Must be called before the first getSampler().
+void initSamplers(SamplerType type, unsigned seed);
+
+extern thread_local Sampler* threadSampler; //!< the calling thread's sampler (NULL until its first getSampler())
+Sampler* newThreadSampler(void); //!< creates (and sets) the sampler of the calling thread. Don't call directly
+
+/// fetch the sampler of the calling thread (similar to getRandomGen())
+inline Sampler& getSampler(void)
+{
+	Sampler* sampler = threadSampler;
+	if (!sampler) sampler = newThreadSampler();
+	return *sampler;
+}
+
+#endif // __SAMPLER_H__
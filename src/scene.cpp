@@ -42,6 +42,7 @@
 #include "random_generator.h"
 #include "heightfield.h"
 #include "lights.h"
+#include "bvh.h"
 #include <assert.h>
 using std::vector;
 using std::string;
@@ -209,9 +210,9 @@ bool ParsedBlockImpl::getVectorProp(const char* name, Vector* value)
 {
 	PBEGIN;
 	stripBracesAndCommas(value_s);
-	Vector v;
-	if (3 != sscanf(value_s, "%lf%lf%lf", &v.x, &v.y, &v.z)) throw SyntaxError(line, "Invalid vector");
-	*value = v;
+	double x, y, z;
+	if (3 != sscanf(value_s, "%lf%lf%lf", &x, &y, &z)) throw SyntaxError(line, "Invalid vector");
+	*value = Vector(x, y, z);
 	return true;
 }
 
@@ -748,6 +749,7 @@ Scene::Scene()
 {
 	environment = NULL;
 	camera = NULL;
+	bvh = NULL;
 }
 
 Scene::~Scene()
@@ -780,6 +782,8 @@ Scene::~Scene()
 	environment = NULL;
 	if (camera) delete camera;
 	camera = NULL;
+	if (bvh) delete bvh;
+	bvh = NULL;
 }
 
 
@@ -800,6 +804,13 @@ void Scene::beginRender()
 	camera->beginRender();
 	settings.beginRender();
 	if (environment) environment->beginRender();
+	// the nodes' transforms and geometries are now final; build the BVH over them:
+	if (bvh) delete bvh;
+	bvh = NULL;
+	if (settings.useBVH) {
+		bvh = new SceneBVH;
+		bvh->build(nodes);
+	}
 }
 
 void Scene::beginFrame()
@@ -813,6 +824,9 @@ void Scene::beginFrame()
 	camera->beginFrame();
 	settings.beginFrame();
 	if (environment) environment->beginFrame();
+	// the nodes may have moved (e.g., animation, or the interactive mode); update the BVH's boxes:
+	if (bvh && !bvh->refit())
+		bvh->build(nodes);
 }
 
 GlobalSettings::GlobalSettings()
@@ -826,9 +840,21 @@ GlobalSettings::GlobalSettings()
 	ambientLight.makeZero();
 	gi = false;
 	numPaths = 40;
+	progressive = false;
+	pathsPerPass = 1;
+	adaptiveSampling = false;
+	adaptiveThresh = 0.1;
+	adaptiveMinSamples = 8;
+	timeLimit = 0;
+	sampler = SAMPLER_SOBOL;
 	numThreads = 0;
+	bucketSize = 48;
+	adaptiveBuckets = true;
+	workerTimeout = 300;
 	interactive = false;
 	fullscreen = true;
+	useBVH = true;
+	usePackets = false;
 }
 
 void GlobalSettings::fillProperties(ParsedBlock& pb)
@@ -843,9 +869,27 @@ void GlobalSettings::fillProperties(ParsedBlock& pb)
 	pb.getDoubleProp("aaThresh", &aaThresh);
 	pb.getBoolProp("gi", &gi);
 	pb.getIntProp("numPaths", &numPaths, 1);
+	pb.getBoolProp("progressive", &progressive);
+	pb.getIntProp("pathsPerPass", &pathsPerPass, 1);
+	pb.getBoolProp("adaptiveSampling", &adaptiveSampling);
+	pb.getDoubleProp("adaptiveThresh", &adaptiveThresh, 0);
+	pb.getIntProp("adaptiveMinSamples", &adaptiveMinSamples, 2);
+	pb.getDoubleProp("timeLimit", &timeLimit, 0);
+	char samplerName[256];
+	if (pb.getStringProp("sampler", samplerName)) {
+		if (!strcmp(samplerName, "random")) sampler = SAMPLER_RANDOM;
+		else if (!strcmp(samplerName, "halton")) sampler = SAMPLER_HALTON;
+		else if (!strcmp(samplerName, "sobol")) sampler = SAMPLER_SOBOL;
+		else pb.signalError("Unknown sampler (expected: random, halton or sobol)");
+	}
 	pb.getIntProp("numThreads", &numThreads, 0, 64);
+	pb.getIntProp("bucketSize", &bucketSize, 8, 1024);
+	pb.getBoolProp("adaptiveBuckets", &adaptiveBuckets);
+	pb.getDoubleProp("workerTimeout", &workerTimeout, 1);
 	pb.getBoolProp("interactive", &interactive);
 	pb.getBoolProp("fullscreen", &fullscreen);
+	pb.getBoolProp("useBVH", &useBVH);
+	pb.getBoolProp("usePackets", &usePackets);
 }
 
 SceneElement* DefaultSceneParser::newSceneElement(const char* className)
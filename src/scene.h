@@ -24,6 +24,7 @@
 #include <limits.h>
 #include "color.h"
 #include "vector.h"
+#include "sampler.h"
 
 enum ElementType {
 	ELEM_GEOMETRY,
@@ -47,6 +48,7 @@ class Environment;
 class Camera;
 class Bitmap;
 class Light;
+class SceneBVH;
 struct Transform;
 
 class ParsedBlock;
@@ -249,15 +251,28 @@ struct GlobalSettings: public SceneElement {
 	bool gi;                     //!< Is GI on?
 	double aaThresh;             //!< The antialiasing color difference threshold (see renderScene)
 	int numPaths;                //!< paths per pixel
+	bool progressive;            //!< GI: render the whole frame in passes, displaying the running average after each (default: false)
+	int pathsPerPass;            //!< progressive mode: paths per pixel in each pass (default: 1)
+	bool adaptiveSampling;       //!< GI/DOF: stop sampling a pixel early, when its noise is low enough (default: false)
+	double adaptiveThresh;       //!< adaptive sampling: max relative half-width of the 95% confidence interval (default: 0.1)
+	int adaptiveMinSamples;      //!< adaptive sampling: samples to take before the first check (default: 8)
+	double timeLimit;            //!< GI: if > 0, render progressively until that many seconds pass, regardless of numPaths (at least one pass is always completed) (default: 0)
+	SamplerType sampler;         //!< GI/DOF: how the sample points are generated: "random", "halton" or "sobol" (default: sobol)
 	
 	int maxTraceDepth;           //!< Maximum recursion depth
 	
 	bool dbg;                    //!< A debugging flag (if on, various raytracing-related procedures will dump debug info to stdout).
 	
 	int numThreads;              //!< # rendering threads (0 to autodetect)
+	int bucketSize;              //!< the size of the image buckets, which are dealt to the rendering threads (default: 48)
+	bool adaptiveBuckets;        //!< split and reorder the buckets by their estimated cost (see scheduleBuckets()) (default: true)
+	double workerTimeout;        //!< distributed rendering: seconds a worker may take to return a unit, before it's considered lost (default: 300)
 	bool interactive;            //!< interactive mode
 	bool fullscreen;             //!< fullscreen in interactive mode (default: true)
 	
+	bool useBVH;                 //!< use a BVH over all nodes, instead of checking them one by one (default: true)
+	bool usePackets;             //!< trace the primary rays in packets, which cover 2x2 pixel blocks (default: false)
+	
 	GlobalSettings();
 	void fillProperties(ParsedBlock& pb);
 	ElementType getElementType() const { return ELEM_SETTINGS; }
@@ -273,6 +288,7 @@ struct Scene {
 	Environment* environment;
 	Camera* camera;
 	GlobalSettings settings;
+	SceneBVH* bvh; //!< an acceleration structure over `nodes'. NULL if disabled (see GlobalSettings::useBVH)
 	
 	Scene();
 	~Scene();
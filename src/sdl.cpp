@@ -19,20 +19,25 @@
  ***************************************************************************/
 #include <SDL/SDL.h>
 #include <stdio.h>
+#include <string.h>
 #include <algorithm>
 #ifdef __MINGW32__
 #	include <windows.h> // for AllocConsole()
 #endif
 #include "sdl.h"
+#include "cxxptl_sdl.h"
 using std::min;
 using std::max;
 
 
 SDL_Surface* screen = NULL;
 SDL_Thread *render_thread;
-SDL_mutex *render_lock;
 volatile bool rendering = false;
 bool render_async, wantToQuit = false;
+static bool headless = false; //!< no window; the display functions do nothing (see initHeadless())
+static int frameW = 0, frameH = 0;
+
+static void flushDisplayQueue(bool execute = true);
 
 void setupConsole(void)
 {
@@ -58,21 +63,32 @@ bool initGraphics(int frameWidth, int frameHeight, bool fullscreen)
 		printf("Cannot set video mode %dx%d - %s\n", frameWidth, frameHeight, SDL_GetError());
 		return false;
 	}
-	render_lock = SDL_CreateMutex();
+	frameW = screen->w;
+	frameH = screen->h;
 	return true;
 }
 
+/// sets up rendering without a window, e.g. for batch renders on machines without a display
+void initHeadless(int frameWidth, int frameHeight)
+{
+	headless = true;
+	frameW = frameWidth;
+	frameH = frameHeight;
+}
+
 /// closes SDL graphics
 void closeGraphics(void)
 {
+	if (headless) return;
 	SDL_FreeSurface(screen);
-	SDL_DestroyMutex(render_lock);
 	SDL_Quit();
 }
 
 /// displays a VFB (virtual frame buffer) to the real framebuffer, with the necessary color clipping
-void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+void displayVFB(const FrameBuffer& vfb)
 {
+	if (headless) return;
+	flushDisplayQueue(false); // any pending partial updates are superseded by the full redraw
 	int rs = screen->format->Rshift;
 	int gs = screen->format->Gshift;
 	int bs = screen->format->Bshift;
@@ -86,6 +102,7 @@ void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
 
 void setWindowCaption(const char* msg, float renderTime)
 {
+	if (headless) return;
 	if (renderTime >= 0) {
 		char message[128];
 		sprintf(message, msg, renderTime);
@@ -98,15 +115,13 @@ void setWindowCaption(const char* msg, float renderTime)
 /// returns the frame width
 int frameWidth(void)
 {
-	if (screen) return screen->w;
-	return 0;
+	return frameW;
 }
 
 /// returns the frame height
 int frameHeight(void)
 {
-	if (screen) return screen->h;
-	return 0;
+	return frameH;
 }
 
 void Rect::clip(int W, int H)
@@ -138,7 +153,7 @@ static void findUnusedFN(char fn[], const char* suffix)
 
 bool takeScreenshot(const char* filename)
 {
-	extern Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]; // from main.cpp
+	extern FrameBuffer vfb; // from main.cpp
 	
 	Bitmap bmp;
 	bmp.generateEmptyImage(frameWidth(), frameHeight());
@@ -205,49 +220,95 @@ void waitForUserExit(void)
 	}
 }
 
-std::vector<Rect> getBucketsList(void)
+std::vector<Rect> getBucketsList(int bucketSize)
 {
 	std::vector<Rect> res;
-	const int BUCKET_SIZE = 48;
 	int W = frameWidth();
 	int H = frameHeight();
-	int BW = (W - 1) / BUCKET_SIZE + 1;
-	int BH = (H - 1) / BUCKET_SIZE + 1;
+	int BW = (W - 1) / bucketSize + 1;
+	int BH = (H - 1) / bucketSize + 1;
 	for (int y = 0; y < BH; y++) {
 		if (y % 2 == 0)
 			for (int x = 0; x < BW; x++)
-				res.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
+				res.push_back(Rect(x * bucketSize, y * bucketSize, (x + 1) * bucketSize, (y + 1) * bucketSize));
 		else
 			for (int x = BW - 1; x >= 0; x--)
-				res.push_back(Rect(x * BUCKET_SIZE, y * BUCKET_SIZE, (x + 1) * BUCKET_SIZE, (y + 1) * BUCKET_SIZE));
+				res.push_back(Rect(x * bucketSize, y * bucketSize, (x + 1) * bucketSize, (y + 1) * bucketSize));
 	}
 	for (int i = 0; i < (int) res.size(); i++)
 		res[i].clip(W, H);
 	return res;
 }
 
-class MutexRAII {
-	SDL_mutex* mutex;
-public:
-	MutexRAII(SDL_mutex* _mutex)
-	{
-		mutex = _mutex;
-		SDL_mutexP(mutex);
-	}
-	~MutexRAII()
-	{
-		SDL_mutexV(mutex);
-	}
+/**
+ * A pending update of the screen, as requested by a render thread.
+ *
+ * The render threads never touch the screen surface themselves; they just push such commands into
+ * displayQueue, and the main thread executes them (see flushDisplayQueue()). This way, a finished
+ * bucket costs its render thread a single interlocked operation, instead of a wait on a global lock
+ * and an SDL_UpdateRect().
+ *
+ * A COPY_VFB command carries a snapshot of the rect's pixels, taken (and converted) by the render thread,
+ * as the vfb itself may be already overwritten (e.g., by the next progressive pass), when the main thread
+ * gets to the command.
+ */
+struct DisplayCommand {
+	enum Type {
+		FILL_RECT,    //!< fill `r' with `color'
+		COPY_VFB,     //!< copy `pixels' to `r'
+		MARK_REGION,  //!< draw the corner brackets around `r', with `color'
+	} type;
+	Rect r;
+	Color color;
+	std::vector<Uint32> pixels; //!< COPY_VFB: the pixels of `r', in the screen's format, row by row
+	DisplayCommand* next;
 };
 
-bool drawRect(Rect r, const Color& c)
+static LockFreeList<DisplayCommand> displayQueue;
+
+// returns false if the render thread is about to be killed, and shouldn't bother with the display anymore
+static inline bool pushDisplayCommand(DisplayCommand::Type type, const Rect& r, const Color& color,
+                                      const FrameBuffer* vfb = NULL)
 {
-	MutexRAII raii(render_lock);
-	
 	if (render_async && !rendering) return false;
+	if (headless) return true;
 	
-	r.clip(frameWidth(), frameHeight());
-	
+	DisplayCommand* cmd = new DisplayCommand;
+	cmd->type = type;
+	cmd->r = r;
+	cmd->r.clip(frameWidth(), frameHeight());
+	cmd->color = color;
+	if (vfb) {
+		const Rect& cr = cmd->r;
+		int rs = screen->format->Rshift;
+		int gs = screen->format->Gshift;
+		int bs = screen->format->Bshift;
+		cmd->pixels.reserve(cr.w * cr.h);
+		for (int y = cr.y0; y < cr.y1; y++)
+			for (int x = cr.x0; x < cr.x1; x++)
+				cmd->pixels.push_back((*vfb)[y][x].toRGB32(rs, gs, bs));
+	}
+	displayQueue.push(cmd);
+	return true;
+}
+
+bool drawRect(Rect r, const Color& c)
+{
+	return pushDisplayCommand(DisplayCommand::FILL_RECT, r, c);
+}
+
+bool displayVFBRect(Rect r, const FrameBuffer& vfb)
+{
+	return pushDisplayCommand(DisplayCommand::COPY_VFB, r, Color(0, 0, 0), &vfb);
+}
+
+bool markRegion(Rect r, const Color& bracketColor)
+{
+	return pushDisplayCommand(DisplayCommand::MARK_REGION, r, bracketColor);
+}
+
+static void executeFillRect(const Rect& r, const Color& c)
+{
 	int rs = screen->format->Rshift;
 	int gs = screen->format->Gshift;
 	int bs = screen->format->Bshift;
@@ -258,40 +319,22 @@ bool drawRect(Rect r, const Color& c)
 		for (int x = r.x0; x < r.x1; x++)
 			row[x] = clr;
 	}
-	SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
-	
-	return true;
 }
 
-bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE])
+static void executeCopyVFB(const Rect& r, const std::vector<Uint32>& pixels)
 {
-	MutexRAII raii(render_lock);
-
-	if (render_async && !rendering) return false;
-	
-	r.clip(frameWidth(), frameHeight());
-	int rs = screen->format->Rshift;
-	int gs = screen->format->Gshift;
-	int bs = screen->format->Bshift;
-	for (int y = r.y0; y < r.y1; y++) {
+	if (pixels.empty()) return;
+	const Uint32* src = &pixels[0];
+	for (int y = r.y0; y < r.y1; y++, src += r.w) {
 		Uint32 *row = (Uint32*) ((Uint8*) screen->pixels + y * screen->pitch);
-		for (int x = r.x0; x < r.x1; x++)
-			row[x] = vfb[y][x].toRGB32(rs, gs, bs);
+		memcpy(row + r.x0, src, r.w * sizeof(Uint32));
 	}
-	SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
-	
-	return true;
 }
 
-bool markRegion(Rect r, const Color& bracketColor)
+static void executeMarkRegion(const Rect& r, const Color& bracketColor)
 {
-	MutexRAII raii(render_lock);
-
-	if (render_async && !rendering) return false;
-	
-	r.clip(frameWidth(), frameHeight());
 	const int L = 8;
-	if (r.w < L+3 || r.h < L+3) return true; // region is too small to be marked
+	if (r.w < L+3 || r.h < L+3) return; // region is too small to be marked
 	const Uint32 BRACKET_COLOR = bracketColor.toRGB32();
 	const Uint32 OUTLINE_COLOR = Color(0.75f, 0.75f, 0.75f).toRGB32();
 	#define DRAW_ONE(x, y, color) \
@@ -317,10 +360,29 @@ bool markRegion(Rect r, const Color& bracketColor)
 	for  (int i = 2; i <= L; i++) {
 		DRAW(i, 1, BRACKET_COLOR);
 	}
-	
-	SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
-	
-	return true;
+	#undef DRAW
+	#undef DRAW_ONE
+}
+
+/// executes (or, if `execute' is false, just discards) all queued display commands.
+/// Must only be called from the main thread.
+static void flushDisplayQueue(bool execute)
+{
+	DisplayCommand* cmd = displayQueue.take_all();
+	while (cmd) {
+		if (execute) {
+			const Rect& r = cmd->r; // (already clipped)
+			switch (cmd->type) {
+				case DisplayCommand::FILL_RECT: executeFillRect(r, cmd->color); break;
+				case DisplayCommand::COPY_VFB: executeCopyVFB(r, cmd->pixels); break;
+				case DisplayCommand::MARK_REGION: executeMarkRegion(r, cmd->color); break;
+			}
+			SDL_UpdateRect(screen, r.x0, r.y0, r.w, r.h);
+		}
+		DisplayCommand* next = cmd->next;
+		delete cmd;
+		cmd = next;
+	}
 }
 
 bool renderScene_Threaded(void)
@@ -337,21 +399,21 @@ bool renderScene_Threaded(void)
 		return false;
 	}
 	
+	// all screen updates happen here, in the main thread; the render thread (and its workers) only queue them:
 	while (!wantToQuit) {
-		{
-			MutexRAII raii(render_lock);
-			if (!rendering) break;
-			SDL_Event ev;
-			while (SDL_PollEvent(&ev)) {
-				handleEvent(ev);
-				if (wantToQuit) break;
-			}
+		flushDisplayQueue();
+		if (!rendering) break;
+		SDL_Event ev;
+		while (SDL_PollEvent(&ev)) {
+			handleEvent(ev);
+			if (wantToQuit) break;
 		}
-		SDL_Delay(100);
+		SDL_Delay(20);
 	}
 	rendering = false;
 	SDL_WaitThread(render_thread, NULL);
 	render_thread = NULL;
+	flushDisplayQueue(!wantToQuit);
 	
 	render_async = false;
 	return true;
@@ -23,13 +23,15 @@
 #include "color.h"
 #include "bitmap.h"
 #include "constants.h"
+#include "framebuffer.h"
 #include <vector>
 
 void initColor(void); //!< sets up a Color->unsigned lookup table, call before everything else!
 void setupConsole(void); //!< setup a text console for printing debug stdout, etc...
 bool initGraphics(int frameWidth, int frameHeight, bool fullscreen);
+void initHeadless(int frameWidth, int frameHeight); //!< render without a window; the display functions become no-ops
 void closeGraphics(void);
-void displayVFB(Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]); //!< displays the VFB (Virtual framebuffer) to the real one.
+void displayVFB(const FrameBuffer& vfb); //!< displays the VFB (Virtual framebuffer) to the real one.
 void waitForUserExit(void); //!< Pause. Wait until the user closes the application
 int frameWidth(void); //!< returns the frame width (pixels)
 int frameHeight(void); //!< returns the frame height (pixels)
@@ -50,7 +52,10 @@ struct Rect {
 };
 
 // generate a list of buckets (image sub-rectangles) to be rendered, in a zigzag pattern
-std::vector<Rect> getBucketsList(void);
+std::vector<Rect> getBucketsList(int bucketSize = 48);
+
+// The following three functions may be called from any thread, and never block: they only queue the
+// update, and the main thread does the actual drawing (in renderScene_Threaded() or displayVFB()).
 
 // fills a rectangle on the screen with a solid color
 // fails if the render thread is about to be killed
@@ -58,7 +63,7 @@ bool drawRect(Rect r, const Color& c);
 
 // same as displayVFB, but only updates a specific region.
 // fails if the thread has to be killed
-bool displayVFBRect(Rect r, Color vfb[VFB_MAX_SIZE][VFB_MAX_SIZE]);
+bool displayVFBRect(Rect r, const FrameBuffer& vfb);
 
 // marks a region (places four temporary green corners)
 // fails if the thread is to be killed
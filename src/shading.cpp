@@ -23,6 +23,7 @@
 #include "lights.h"
 #include "shading.h"
 #include "random_generator.h"
+#include "sampler.h"
 
 using std::max;
 
@@ -40,6 +41,11 @@ void BRDF::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, Colo
 	pdf = -1;
 }
 
+float BRDF::pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out)
+{
+	return 0;
+}
+
 Shader::Shader(const Color& color)
 {
 	this->color = color;
@@ -82,7 +88,7 @@ Color Lambert::shade(const Ray& ray, const IntersectionData& data)
 			Vector lightPos;
 			Color lightColor;
 			scene.lights[i]->getNthSample(j, data.p, lightPos, lightColor);
-			if (lightColor.intensity() != 0 && testVisibility(data.p + N * 1e-6, lightPos)) {
+			if (lightColor.intensity() != 0 && testVisibility(data.p + N * surfaceEpsilon(data.p), lightPos)) {
 				Vector lightDir = lightPos - data.p;
 				lightDir.normalize();
 				
@@ -103,28 +109,31 @@ Color Lambert::eval(const IntersectionData& x, const Ray& w_in, const Ray& w_out
 	Vector N = faceforward(w_in.dir, x.normal);
 	Color diffuseColor = this->color;
 	if (texture) diffuseColor = texture->getTexColor(w_in, x.u, x.v, N);
-	return diffuseColor * (1 / PI) * max(0.0, dot(w_out.dir, N));
+	return diffuseColor * (1 / PI) * max((real) 0, dot(w_out.dir, N));
 }
 
-Vector hemisphereSample(const Vector& normal)
+/// returns a direction in the hemisphere around `normal', from the point (u, v) in the unit square. The directions
+/// are cosine-weighted: their pdf is cos(theta) / PI, where theta is the angle to the normal. This is Malley's
+/// method: pick a point in the unit disc uniformly, and project it up onto the hemisphere.
+static Vector cosineHemisphereSample(const Vector& normal, float u, float v)
 {
-	Random& rgen = getRandomGen();
-	
-	double u = rgen.randdouble();
-	double v = rgen.randdouble();
-	
-	double theta = 2 * PI * u;
-	double phi = acos(2 * v - 1) - PI/2;
-	
-	Vector res(
-		cos(theta) * cos(phi),
-		sin(phi),
-		sin(theta) * cos(phi)
-	);
-	
-	if (dot(res, normal) < 0)
-		res = -res;
-	return res;
+	double x, y;
+	concentricDiscSample(u, v, x, y);
+	Vector a, b;
+	orthonormedSystem(normal, a, b);
+	return a * x + b * y + normal * sqrt(max(0.0, 1 - x * x - y * y));
+}
+
+/// returns a direction around `axis', from the point (u, v) in the unit square. The pdf of the directions
+/// is (exponent + 1) / (2 * PI) * cos(alpha)^exponent, where alpha is the angle to the axis.
+static Vector phongLobeSample(const Vector& axis, double exponent, float u, float v)
+{
+	double cosAlpha = pow((double) u, 1 / (exponent + 1));
+	double sinAlpha = sqrt(max(0.0, 1 - cosAlpha * cosAlpha));
+	double phi = 2 * PI * v;
+	Vector a, b;
+	orthonormedSystem(axis, a, b);
+	return a * (cos(phi) * sinAlpha) + b * (sin(phi) * sinAlpha) + axis * cosAlpha;
 }
 
 void Lambert::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, Color& colorEval, float& pdf)
@@ -136,11 +145,20 @@ void Lambert::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, C
 	w_out = w_in;
 	
 	w_out.depth++;
-	w_out.start = x.p + N * 1e-6;
-	w_out.dir = hemisphereSample(N);
+	w_out.start = x.p + N * surfaceEpsilon(x.p);
+	float u, v;
+	getSampler().get2D(u, v);
+	w_out.dir = cosineHemisphereSample(N, u, v);
 	w_out.flags = w_out.flags | RF_DIFFUSE;
-	colorEval = diffuseColor * (1 / PI) * max(0.0, dot(w_out.dir, N));
-	pdf = 1 / (2 * PI);
+	float cosTheta = (float) max((real) 0, dot(w_out.dir, N));
+	colorEval = diffuseColor * (1 / PI) * cosTheta;
+	pdf = cosTheta / PI;
+}
+
+float Lambert::pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out)
+{
+	Vector N = faceforward(w_in.dir, x.normal);
+	return (float) max((real) 0, dot(w_out.dir, N)) / PI;
 }
 
 Color Phong::shade(const Ray& ray, const IntersectionData& data)
@@ -162,7 +180,7 @@ Color Phong::shade(const Ray& ray, const IntersectionData& data)
 			Vector lightPos;
 			Color lightColor;
 			scene.lights[i]->getNthSample(j, data.p, lightPos, lightColor);
-			if (lightColor.intensity() != 0 && testVisibility(data.p + N * 1e-6, lightPos)) {
+			if (lightColor.intensity() != 0 && testVisibility(data.p + N * surfaceEpsilon(data.p), lightPos)) {
 				Vector lightDir = lightPos - data.p;
 				lightDir.normalize();
 				
@@ -194,6 +212,81 @@ Color Phong::shade(const Ray& ray, const IntersectionData& data)
 	return diffuseColor * lightContrib + specular;
 }
 
+// the probability that Phong::spawnRay() samples the specular lobe, instead of the diffuse one
+float Phong::specularProbability(Color diffuseColor) const
+{
+	float diffuse = diffuseColor.intensity();
+	return diffuse + strength > 0 ? strength / (diffuse + strength) : 0;
+}
+
+// the BRDF (times the cosine term), for light going from `dir' towards -`w_in', at a point with normal N. R is
+// the mirror reflection of w_in. The specular lobe is the normalized (energy-conserving) modified Phong one
+Color Phong::evalDir(const Vector& N, const Vector& R, const Color& diffuseColor, const Vector& dir) const
+{
+	double cosTheta = dot(dir, N);
+	if (cosTheta <= 0) return Color(0, 0, 0);
+	Color result = diffuseColor * (1 / PI);
+	double cosAlpha = dot(dir, R);
+	if (cosAlpha > 0) {
+		float specular = float(strength * (exponent + 2) / (2 * PI) * pow(cosAlpha, exponent));
+		result += Color(specular, specular, specular); // not multiplied by diffuseColor; see shade()
+	}
+	return result * (float) cosTheta;
+}
+
+// the pdf of the directions, chosen by Phong::spawnRay()
+float Phong::pdfDir(const Vector& N, const Vector& R, float pSpecular, const Vector& dir) const
+{
+	double cosTheta = dot(dir, N);
+	if (cosTheta <= 0) return 0;
+	double cosAlpha = max(0.0, (double) dot(dir, R));
+	return float((1 - pSpecular) * cosTheta / PI + pSpecular * (exponent + 1) / (2 * PI) * pow(cosAlpha, exponent));
+}
+
+Color Phong::eval(const IntersectionData& x, const Ray& w_in, const Ray& w_out)
+{
+	Vector N = faceforward(w_in.dir, x.normal);
+	Color diffuseColor = this->color;
+	if (texture) diffuseColor = texture->getTexColor(w_in, x.u, x.v, N);
+	return evalDir(N, reflect(w_in.dir, N), diffuseColor, w_out.dir);
+}
+
+void Phong::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, Color& colorEval, float& pdf)
+{
+	Vector N = faceforward(w_in.dir, x.normal);
+	Color diffuseColor = this->color;
+	if (texture) diffuseColor = texture->getTexColor(w_in, x.u, x.v, N);
+	Vector R = reflect(w_in.dir, N);
+	float pSpecular = specularProbability(diffuseColor);
+
+	w_out = w_in;
+	
+	w_out.depth++;
+	w_out.start = x.p + N * surfaceEpsilon(x.p);
+	// choose one of the lobes randomly, and sample it:
+	Sampler& sampler = getSampler();
+	float u, v;
+	sampler.get2D(u, v);
+	if (sampler.get1D() < pSpecular)
+		w_out.dir = phongLobeSample(R, exponent, u, v);
+	else
+		w_out.dir = cosineHemisphereSample(N, u, v);
+	// the direct lighting in pathtrace() accounts for both lobes, so the light hits are discarded for both:
+	w_out.flags = w_out.flags | RF_DIFFUSE;
+	// the pdf is for the combined sampling, since either lobe could have produced that direction:
+	pdf = pdfDir(N, R, pSpecular, w_out.dir);
+	colorEval = evalDir(N, R, diffuseColor, w_out.dir);
+	if (pdf == 0) colorEval.makeZero(); // the specular lobe went below the surface
+}
+
+float Phong::pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out)
+{
+	Vector N = faceforward(w_in.dir, x.normal);
+	Color diffuseColor = this->color;
+	if (texture) diffuseColor = texture->getTexColor(w_in, x.u, x.v, N);
+	return pdfDir(N, reflect(w_in.dir, N), specularProbability(diffuseColor), w_out.dir);
+}
+
 static Color getTexValue(const Bitmap& bmp, double u, double v)
 {
 	u = u - floor(u);
@@ -219,7 +312,7 @@ Color Refl::shade(const Ray& ray, const IntersectionData& data)
 		Vector reflected = reflect(ray.dir, N);
 		
 		Ray newRay = ray;
-		newRay.start = data.p + N * 1e-6;
+		newRay.start = data.p + N * surfaceEpsilon(data.p);
 		newRay.dir = reflected;
 		newRay.depth = ray.depth + 1;
 		return raytrace(newRay) * color;
@@ -252,7 +345,7 @@ Color Refl::shade(const Ray& ray, const IntersectionData& data)
 			
 			// sample the resulting valid ray, and add to the sum
 			Ray newRay = ray;
-			newRay.start = data.p + N * 1e-6;
+			newRay.start = data.p + N * surfaceEpsilon(data.p);
 			newRay.dir = reflected;
 			newRay.depth = ray.depth + 1;
 			newRay.flags |= RF_GLOSSY;
@@ -283,7 +376,7 @@ void Refl::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, Colo
 	Vector reflected = reflect(w_in.dir, N);
 	
 	w_out = w_in;
-	w_out.start = x.p + N * 1e-6;
+	w_out.start = x.p + N * surfaceEpsilon(x.p);
 	w_out.dir = reflected;
 	w_out.depth++;
 	w_out.flags &= ~RF_DIFFUSE;
@@ -309,7 +402,7 @@ Color Refr::shade(const Ray& ray, const IntersectionData& data)
 	if (refracted.lengthSqr() == 0) return Color(0, 0, 0);
 	
 	Ray newRay = ray;
-	newRay.start = data.p + ray.dir * 1e-6;
+	newRay.start = data.p + ray.dir * surfaceEpsilon(data.p);
 	newRay.dir = refracted;
 	newRay.depth = ray.depth + 1;
 	return raytrace(newRay) * color;
@@ -341,7 +434,7 @@ void Refr::spawnRay(const IntersectionData& x, const Ray& w_in, Ray& w_out, Colo
 	}
 	
 	w_out = w_in;
-	w_out.start = x.p + w_in.dir * 1e-6;
+	w_out.start = x.p + w_in.dir * surfaceEpsilon(x.p);
 	w_out.dir = refracted;
 	w_out.depth++;
 	w_out.flags &= ~RF_DIFFUSE;
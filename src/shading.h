@@ -31,6 +31,10 @@ public:
 
 	virtual void spawnRay(const IntersectionData& x, const Ray& w_in, 
 		Ray& w_out, Color& colorEval, float& pdf);
+
+	/// the pdf, with which spawnRay() would choose w_out. 0 for BRDFs, which can't be sampled by the
+	/// lights (perfect mirrors and refractions: they choose a single direction)
+	virtual float pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out);
 };
 
 /// An abstract class, representing a shader in our scene.
@@ -128,6 +132,8 @@ public:
 
 	void spawnRay(const IntersectionData& x, const Ray& w_in, 
 		Ray& w_out, Color& colorEval, float& pdf);
+
+	float pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out);
 };
 
 /// A Phong shader
@@ -135,6 +141,9 @@ class Phong: public Shader {
 	Texture* texture; //!< a diffuse texture, if not NULL.
 	double exponent; //!< exponent ("shininess") of the material
 	float strength; //!< strength of the cos^n specular component (0..1)
+	float specularProbability(Color diffuseColor) const;
+	Color evalDir(const Vector& N, const Vector& R, const Color& diffuseColor, const Vector& dir) const;
+	float pdfDir(const Vector& N, const Vector& R, float pSpecular, const Vector& dir) const;
 public:
 	Phong(const Color& diffuseColor = Color(1, 1, 1), double exponent = 16.0, float strength = 1.0f, Texture* texture = NULL):
 		Shader(diffuseColor), texture(texture), exponent(exponent),
@@ -147,6 +156,13 @@ public:
 		pb.getFloatProp("strength", &strength, 0, 1e6);
 		pb.getTextureProp("texture", &texture);
 	}
+
+	Color eval(const IntersectionData& x, const Ray& w_in, const Ray& w_out);
+
+	void spawnRay(const IntersectionData& x, const Ray& w_in, 
+		Ray& w_out, Color& colorEval, float& pdf);
+
+	float pdf(const IntersectionData& x, const Ray& w_in, const Ray& w_out);
 };
 
 class Refl: public Shader {
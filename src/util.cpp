@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 
 #include <string>
+#include <chrono>
 using namespace std;
 
 string upCaseString(string s)
@@ -59,3 +60,8 @@ bool fileExists(const char* fn)
 	struct stat st;
 	return (0 == stat(temp, &st));
 }
+
+double getPreciseTime()
+{
+	return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
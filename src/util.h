@@ -35,6 +35,7 @@ inline int nearestInt(float x) { return (int) floor(x + 0.5f); }
 std::string upCaseString(std::string s); //!< returns the string in UPPERCASE
 std::string extensionUpper(const char* fileName); //!< Given a filename, return its extension in UPPERCASE
 bool fileExists(const char* filename); //!< returns true if a file can be opened
+double getPreciseTime(); //!< returns the time in seconds (from some unspecified point), with at least microsecond resolution
 
 /// a simple RAII class for FILE* pointers.
 class FileRAII {
@@ -25,16 +25,25 @@
 #include <ostream>
 #include <iomanip>
 
+/// The scalar type of the geometry core: Vector, and thus rays, triangles, bounding boxes and intersection data.
+/// It is double by default; building with -DTRINITY_SINGLE_PRECISION switches it to float, which halves the
+/// memory and bandwidth of large meshes and the cache footprint of each ray (double remains handy for debugging).
+#ifdef TRINITY_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
 struct Vector {
 	union {
-		struct { double x, y, z; };
-		double components[3];
+		struct { real x, y, z; };
+		real components[3];
 	};
 	
 	/////////////////////////
 	Vector () {}
-	Vector(double _x, double _y, double _z) { set(_x, _y, _z); }
-	void set(double _x, double _y, double _z)
+	Vector(real _x, real _y, real _z) { set(_x, _y, _z); }
+	void set(real _x, real _y, real _z)
 	{
 		x = _x;
 		y = _y;
@@ -44,21 +53,21 @@ struct Vector {
 	{
 		x = y = z = 0.0;
 	}
-	inline double length(void) const
+	inline real length(void) const
 	{
 		return sqrt(x * x + y * y + z * z);
 	}
-	inline double lengthSqr(void) const
+	inline real lengthSqr(void) const
 	{
 		return (x * x + y * y + z * z);
 	}
-	void scale(double multiplier)
+	void scale(real multiplier)
 	{
 		x *= multiplier;
 		y *= multiplier;
 		z *= multiplier;
 	}
-	void operator *= (double multiplier)
+	void operator *= (real multiplier)
 	{
 		scale(multiplier);
 	}
@@ -68,25 +77,25 @@ struct Vector {
 		y += rhs.y;
 		z += rhs.z;
 	}
-	void operator /= (double divider)
+	void operator /= (real divider)
 	{
 		scale(1.0 / divider);
 	}
 	void normalize(void)
 	{
-		double multiplier = 1.0 / length();
+		real multiplier = 1.0 / length();
 		scale(multiplier);
 	}
-	void setLength(double newLength)
+	void setLength(real newLength)
 	{
 		scale(newLength / length());
 	}
 	
-	inline double& operator[] (int index)
+	inline real& operator[] (int index)
 	{
 		return components[index];
 	}
-	inline const double& operator[] (int index) const
+	inline const real& operator[] (int index) const
 	{
 		return components[index];
 	}
@@ -94,7 +103,7 @@ struct Vector {
 	int maxDimension() const
 	{
 		int bi = 0;
-		double maxD = fabs(x);
+		real maxD = fabs(x);
 		if (fabs(y) > maxD) { maxD = fabs(y); bi = 1; }
 		if (fabs(z) > maxD) { maxD = fabs(z); bi = 2; }
 		return bi;
@@ -117,12 +126,12 @@ inline Vector operator - (const Vector& a)
 }
 
 /// dot product
-inline double operator * (const Vector& a, const Vector& b)
+inline real operator * (const Vector& a, const Vector& b)
 {
 	return a.x * b.x + a.y * b.y + a.z * b.z;
 }
 /// dot product (functional form, to make it more explicit):
-inline double dot(const Vector& a, const Vector& b)
+inline real dot(const Vector& a, const Vector& b)
 {
 	return a.x * b.x + a.y * b.y + a.z * b.z;
 }
@@ -136,26 +145,44 @@ inline Vector operator ^ (const Vector& a, const Vector& b)
 	);
 }
 
-inline Vector operator * (const Vector& a, double multiplier)
+inline Vector operator * (const Vector& a, real multiplier)
 {
 	return Vector(a.x * multiplier, a.y * multiplier, a.z * multiplier);
 }
-inline Vector operator * (double multiplier, const Vector& a)
+inline Vector operator * (real multiplier, const Vector& a)
 {
 	return Vector(a.x * multiplier, a.y * multiplier, a.z * multiplier);
 }
-inline Vector operator / (const Vector& a, double divider)
+inline Vector operator / (const Vector& a, real divider)
 {
-	double multiplier = 1.0 / divider;
+	real multiplier = 1.0 / divider;
 	return Vector(a.x * multiplier, a.y * multiplier, a.z * multiplier);
 }
 
 inline Vector normalize(const Vector& vec)
 {
-	double multiplier = 1.0 / vec.length();
+	real multiplier = 1.0 / vec.length();
 	return vec * multiplier;
 }
 
+/**
+ * Gets the small distance, used to step off a surface near the point p (e.g. when spawning a secondary
+ * ray), or to tolerate roundoff errors around it. With doubles, this is just 1e-6. Floats only have 24
+ * bits of mantissa, so there the distance has to grow with the magnitude of p's coordinates, otherwise
+ * the step would get lost in roundoff.
+ */
+inline real surfaceEpsilon(const Vector& p)
+{
+#ifdef TRINITY_SINGLE_PRECISION
+	real magnitude = fabsf(p.x);
+	if (fabsf(p.y) > magnitude) magnitude = fabsf(p.y);
+	if (fabsf(p.z) > magnitude) magnitude = fabsf(p.z);
+	return 1e-5f * (1 + magnitude);
+#else
+	return 1e-6;
+#endif
+}
+
 inline Vector reflect(const Vector& ray, const Vector& norm)
 {
 	Vector result = ray - 2 * dot(ray, norm) * norm;
@@ -203,7 +230,8 @@ enum RayFlags {
 	// so if it meets a new glossy surface, it can safely use lower sampling settings.
 	RF_GLOSSY   = 0x0004,
 	
-	// last constituent of a ray path was a diffuse surface
+	// last constituent of a ray path was a diffuse (or glossy) surface, i.e., not a perfect mirror or
+	// refraction. So the light sampling could've chosen that direction as well (see pathtrace())
 	RF_DIFFUSE  = 0x0008,
 };
 